@@ -16,7 +16,6 @@
  *------------------------------------------------------------------------------*/
 
 #include <errno.h>
-#include <poll.h>
 
 #include "utils.h"
 #include "window.h"
@@ -25,14 +24,33 @@
 #include "term.h"
 #include "color.h"
 #include "options.h"
+#include "evloop.h"
+#include "gfx_draw.h"
+#include "perf.h"
 #include "app.h"
 
 // Option limits
 enum {
     MIN_BORDER = (0),
     MAX_BORDER = (INT16_MAX / 2),
+    MIN_REFRESH = (10),
+    MAX_REFRESH = (1000),
 };
 
+// Assumed refresh rate when neither specified nor measurable
+#define DEFAULT_REFRESH 60
+// Number of swaps timed to measure the display's refresh rate
+#define REFRESH_SAMPLES 8
+// Bytes parsed per frame that start (and a quarter of which end) a flood
+#define FLOOD_BYTES (1 << 19)
+// Time the window size must stay the same before the child is told about it (ns)
+#define WINSIZE_DELAY 100000000
+// Time a blinking cursor spends in each phase (ns)
+#define BLINK_INTERVAL 500000000
+
+// Number of frames summarized by the performance overlay
+#define HUD_FRAMES 120
+
 static const struct {
     Options opts;
     const char *colors[NUM_COLORS];
@@ -50,6 +68,7 @@ static const struct {
         .tabcols   = 8,
         .border    = 0,
         .histlines = 128,
+        .refresh   = 0,
     },
     .colors = {
         [BLACK]    = "#34373c",
@@ -89,6 +108,31 @@ struct App {
     int argc;
     const char **argv;
     Palette palette;
+    bool hud;    // Performance overlay is visible
+    EvLoop *loop;
+    int ptyfd;
+    int srvfd;
+    int outfd;         // PTY master, watched while input is queued for the child
+    uint64 frame_time; // Display refresh interval (ns)
+    uint64 swap_time;  // Completion of the last buffer swap
+    uint64 key_time;   // Last key press sent to the child
+    size_t frame_bytes; // Bytes parsed during the current frame
+    struct {
+        bool pending;   // Window size changed since the last frame
+        int width;
+        int height;
+        uint64 due;     // When to report the new size to the child, if nonzero
+    } resize;
+    struct {
+        bool off;       // Blinking cursor is in its off phase
+        uint64 due;     // Next phase change, if nonzero
+    } blink;
+    struct {
+        bool active;
+        uint64 start;   // Start of the current flood
+        uint64 bytes;   // Bytes parsed during the current flood
+        uint64 total;   // Bytes parsed during all floods
+    } flood;
 };
 
 static App app_;
@@ -99,12 +143,18 @@ static void setup_fonts(App *app);
 static void setup_window(App *app);
 static void setup_terminal(App *app);
 static int run(App *app);
-static int run_frame(App *app, struct pollfd *pollset);
-static bool run_updates(App *app, struct pollfd *pollset, int timeout, int *r_error);
+static int run_frame(App *app);
+static bool run_updates(App *app, bool *r_echo, int *r_error);
+static uint64 measure_frame_time(App *app);
+static void update_flood(App *app);
+static void update_size(App *app);
+static void update_blink(App *app);
+static uint64 next_timer(const App *app);
 
 static WinEventHandler on_event;
 static void on_resize_event(App *app, const WinGeomEvent *event);
 static void on_keypress_event(App *app, const WinKeyEvent *event);
+static void draw_hud(App *app);
 
 int
 app_main(const Options *opts)
@@ -115,9 +165,15 @@ app_main(const Options *opts)
     merge_options(&app->opts, opts);
 
     setup(app);
+    perf_probe_enable(app->opts.latency);
 
     int result = run(app);
 
+    if (app->opts.perf_csv) {
+        perf_write_csv(app->opts.perf_csv);
+    }
+    perf_probe_report(stderr);
+
     term_destroy(app->term);
     fontset_destroy(app->fontset);
     window_destroy(app->win);
@@ -139,10 +195,16 @@ merge_options(Options *restrict dst, const Options *restrict src)
     MERGE_NONNULL(shell);
     MERGE_NONNULL(font);
     MERGE_NONNULL(fontpath);
+    MERGE_NONNULL(perf_csv);
     MERGE_INRANGE(border, MIN_BORDER, MAX_BORDER);
     MERGE_INRANGE(histlines, MIN_HISTLINES, MAX_HISTLINES);
     MERGE_INRANGE(cols, MIN_COLS, MAX_COLS);
     MERGE_INRANGE(rows, MIN_ROWS, MAX_ROWS);
+    MERGE_INRANGE(refresh, MIN_REFRESH, MAX_REFRESH);
+    dst->novsync = src->novsync;
+    dst->noblink = src->noblink;
+    dst->software = src->software;
+    dst->latency = src->latency;
 #undef MERGE_NONNULL
 #undef MERGE_INRANGE
 }
@@ -155,13 +217,17 @@ setup(App *app)
     // can't deduce until the window is visible - but the window size we *ask for* depends
     // on the font size, which depends on the DPI, which depends on the window server
     // being online... which is why we do this first.
-    app->win = window_create();
+    app->win = window_create(app->opts.software);
 
     if (!app->win) {
         err_printf("Failed to initialize window server\n");
         exit(1);
     }
 
+    if (window_is_software(app->win)) {
+        gfx_set_renderer(GfxRendererSoftware);
+    }
+
     app->dpi = window_get_dpi(app->win);
 
     // Set palette default values
@@ -223,7 +289,7 @@ setup_fonts(App *app)
                app->ascent,
                app->descent);
 
-    if (!fontset_init(app->fontset)) {
+    if (!fontset_init(app->fontset, window_is_software(app->win))) {
         err_printf("Failed to initialize font cache\n");
         exit(1);
     }
@@ -274,6 +340,54 @@ setup_window(App *app)
                app->cwidth,
                app->cheight,
                app->opts.border);
+
+    // Presenting a software-rendered image isn't synced to anything
+    const bool vsync = !app->opts.novsync && !window_is_software(app->win);
+
+    window_set_vsync(app->win, vsync);
+
+    if (app->opts.refresh) {
+        app->frame_time = 1e9 / app->opts.refresh;
+    } else if (!vsync || !(app->frame_time = measure_frame_time(app))) {
+        app->frame_time = 1e9 / DEFAULT_REFRESH;
+    }
+
+    dbg_printf("Refresh rate: %.2f hz (vsync %s)\n",
+               1e9 / app->frame_time,
+               (vsync) ? "on" : "off");
+}
+
+// Times a few swaps of a blank window. With vsync, each one blocks until the next vertical
+// blank. Returns 0 if they don't, e.g. when the driver or compositor ignores the swap interval
+uint64
+measure_frame_time(App *app)
+{
+    uint64 times[REFRESH_SAMPLES+1];
+
+    for (uint i = 0; i < LEN(times); i++) {
+        gfx_clear_rgb1u(app->palette.bg);
+        window_refresh(app->win);
+        times[i] = perf_now();
+    }
+
+    // Median of the intervals, so one missed vblank doesn't skew the result
+    uint64 deltas[REFRESH_SAMPLES];
+    for (uint i = 0; i < LEN(deltas); i++) {
+        const uint64 delta = times[i+1] - times[i];
+        uint j = i;
+        for (; j > 0 && deltas[j-1] > delta; j--) {
+            deltas[j] = deltas[j-1];
+        }
+        deltas[j] = delta;
+    }
+
+    const uint64 median = deltas[LEN(deltas)/2];
+
+    if (median < 1e9 / MAX_REFRESH || median > 1e9 / MIN_REFRESH) {
+        return 0;
+    }
+
+    return median;
 }
 
 void
@@ -299,89 +413,186 @@ run(App *app)
 
     int result = 0;
 
-    const int srvfd = window_get_fileno(app->win);
-    ASSERT(srvfd);
-    const int ptyfd = term_exec(term, app->opts.shell, app->argc, app->argv);
+    app->srvfd = window_get_fileno(app->win);
+    ASSERT(app->srvfd);
+    app->ptyfd = term_exec(term, app->opts.shell, app->argc, app->argv);
+    app->outfd = -1;
 
-    if (ptyfd) {
-        dbg_printf("Terminal online: fd=%d\n", ptyfd);
+    if (app->ptyfd) {
+        dbg_printf("Terminal online: fd=%d\n", app->ptyfd);
     } else {
         err_printf("Failed to start terminal\n");
-        result = 1;
+        return 1;
     }
 
-    struct pollfd pollset[2] = {
-        { .fd = ptyfd, .events = POLLIN, .revents = 0 },
-        { .fd = srvfd, .events = POLLIN, .revents = 0 }
-    };
+    if (!(app->loop = evloop_create()) ||
+        !evloop_add(app->loop, app->ptyfd, EVLOOP_IN) ||
+        !evloop_add(app->loop, app->srvfd, EVLOOP_IN))
+    {
+        err_printf("Failed to set up event loop\n");
+        result = 1;
+    }
 
     while (!result && window_online(app->win)) {
-        result = run_frame(app, pollset);
+        result = run_frame(app);
     }
 
+    evloop_destroy(app->loop);
+    app->loop = NULL;
+
     return (result && result != ECHILD) ? result : 0;
 }
 
 bool
-run_updates(App *app, struct pollfd *pollset, int timeout, int *r_error)
+run_updates(App *app, bool *r_echo, int *r_error)
 {
+    ASSERT(r_echo);
     ASSERT(r_error);
+    *r_echo = false;
     *r_error = 0;
 
-    int nbytes = 0;
-    int nevents = 0;
+    size_t nbytes = 0;
+    uint64 t;
+
+    // Xlib may have queued events while we were busy (e.g. while waiting on a reply),
+    // which won't wake us. Likewise, the parser may have finished more input. In either
+    // case, only check for more without blocking
+    t = perf_now();
+    int nevents = window_pump_events(app->win, on_event, app);
+    perf_add(PERF_EVENTS, t);
+
+    nbytes = term_poll(app->term);
+
+    // Wait for the PTY to become writeable only while there's something to write
+    const size_t queued = term_flush(app->term);
+    const int outfd = (queued) ? term_get_fileno(app->term) : -1;
+    perf_probe_write(queued);
+    if (outfd != app->outfd) {
+        if (app->outfd >= 0) {
+            evloop_remove(app->loop, app->outfd);
+        }
+        if (outfd >= 0) {
+            evloop_add(app->loop, outfd, EVLOOP_OUT);
+        }
+        app->outfd = outfd;
+    }
+
     errno = 0;
 
-    const int res = poll(pollset, 2, timeout);
+    t = perf_now();
+    const int res = evloop_wait(app->loop, !nevents && !nbytes);
+    perf_add(PERF_POLL, t);
+
+    const uint ptyev = evloop_revents(app->loop, app->ptyfd);
+    const uint srvev = evloop_revents(app->loop, app->srvfd);
+
     if (res < 0) {
-        err_printf("poll: %s\n", strerror(errno));
+        err_printf("evloop_wait: %s\n", strerror(errno));
         *r_error = errno;
-    } else if ((pollset[0].revents|pollset[1].revents) & POLLHUP) {
+    } else if ((ptyev|srvev) & EVLOOP_HUP) {
         *r_error = ECHILD;
     } else {
-        nevents = window_pump_events(app->win, on_event, app);
-        if (res && pollset[0].revents & POLLIN) {
-            nbytes = term_pull(app->term);
+        if (srvev & EVLOOP_IN) {
+            t = perf_now();
+            nevents += window_pump_events(app->win, on_event, app);
+            perf_add(PERF_EVENTS, t);
+        }
+        if (ptyev & EVLOOP_IN) {
+            nbytes += term_poll(app->term);
+        }
+        if (nbytes) {
+            perf_probe_read(nbytes);
+            app->frame_bytes += nbytes;
+            // Output following a key press that hasn't been presented yet. Most likely
+            // the echo, which the user is waiting on. Not so during a flood
+            *r_echo = (app->key_time > app->swap_time && !app->flood.active);
         }
     }
 
     return (nevents || nbytes);
 }
 
+// Processes updates until the frame's deadline, which is armed by the first update.
+// Nothing is scheduled while idle, so the loop sleeps until there's something to do. A
+// cursor blink on its own only redraws the cursor
 int
-run_frame(App *app, struct pollfd *pollset)
+run_frame(App *app)
 {
-    const int t0 = timer_msec(NULL);
-    int t1 = t0;
-
     bool need_draw = false;
+    bool need_cursor = false;
     int error = 0;
 
-    // Slightly faster than 60 hz. The refresh rate should become configurable at some point
-    const int min_time = 1e3 / (60 * 1.15);
-    const int max_time = min_time * 2;
+    perf_frame_begin();
+    app->frame_bytes = 0;
+
+    // Without a frame to draw, the next thing to wake up for is the child's size update
+    // or the cursor's next blink
+    evloop_set_deadline(app->loop, next_timer(app));
 
-    for (int limit = min_time;;) {
-        const bool res = run_updates(app, pollset, 2, &error);
-        t1 = timer_msec(NULL);
-        if (error) {
+    for (;;) {
+        bool echo;
+        const bool res = run_updates(app, &echo, &error);
+        if (error || !window_online(app->win)) {
             goto done_frame;
         }
-        need_draw |= res;
-        // We try to extend this frame into the next one if we receive updates in the
-        // last polling interval. It usually means there's more input coming, but the
-        // PTY hasn't given it to us yet
-        if ((t1 - t0 >= limit &&
-             (!res || (limit += min_time) > max_time)))
-        {
+        if (app->resize.due && perf_now() >= app->resize.due) {
+            term_sync_winsize(app->term);
+            app->resize.due = 0;
+            if (!need_draw) {
+                evloop_set_deadline(app->loop, next_timer(app));
+            }
+        }
+        if (app->blink.due && perf_now() >= app->blink.due) {
+            // Rearmed once the phase was drawn
+            app->blink.off = !app->blink.off;
+            app->blink.due = 0;
+            term_set_blink(app->term, !app->blink.off);
+            need_cursor = true;
+        }
+        if (res) {
+            const uint64 now = perf_now();
+            uint64 deadline = now;
+            // Echo is drawn right away. Anything else is presented at most once per refresh,
+            // a little ahead of the next vertical blank so the swap doesn't miss it. After
+            // an idle period, we still wait briefly to coalesce the start of a burst
+            if (!echo) {
+                deadline = MAX(now + app->frame_time / 8,
+                               app->swap_time + app->frame_time * 7 / 8);
+            }
+            if (!need_draw || deadline < evloop_get_deadline(app->loop)) {
+                evloop_set_deadline(app->loop, deadline);
+            }
+            need_draw = true;
+        }
+        if (need_draw && evloop_expired(app->loop)) {
+            break;
+        } else if (need_cursor && !need_draw) {
             break;
         }
     }
 
+    evloop_set_deadline(app->loop, 0);
+
     if (need_draw) {
+        update_size(app);
         term_draw(app->term);
-        window_refresh(app->win);
+    } else {
+        term_draw_cursor(app->term);
+    }
+    if (app->hud) {
+        draw_hud(app);
     }
+    perf_probe_draw();
+
+    const uint64 t = perf_now();
+    window_refresh(app->win);
+    app->swap_time = perf_now();
+    perf_add(PERF_SWAP, t);
+    perf_probe_swap();
+
+    perf_frame_end();
+    update_flood(app);
+    update_blink(app);
 
 done_frame:
     return error;
@@ -403,22 +614,42 @@ on_event(void *arg, const WinEvent *event)
     case EVENT_KEYPRESS:
         on_keypress_event(app, &event->as_key);
         break;
+    case EVENT_EXPOSE:
+        // Handled as an update, so the frame that presents it is drawn shortly
+        gfx_expose();
+        break;
     default:
         break;
     }
 }
 
+// Resizes are applied once per frame, with the latest geometry
 void
 on_resize_event(App *app, const WinGeomEvent *event)
 {
-    if (event->width == app->width && event->height == app->height) {
+    app->resize.pending = true;
+    app->resize.width   = event->width;
+    app->resize.height  = event->height;
+}
+
+void
+update_size(App *app)
+{
+    if (!app->resize.pending) {
+        return;
+    }
+
+    app->resize.pending = false;
+
+    if (app->resize.width == app->width && app->resize.height == app->height) {
         return;
     }
 
-    term_resize(app->term, event->width, event->height);
+    term_resize(app->term, app->resize.width, app->resize.height);
 
-    app->width  = event->width;
-    app->height = event->height;
+    app->width  = app->resize.width;
+    app->height = app->resize.height;
+    app->resize.due = perf_now() + WINSIZE_DELAY;
 }
 
 void
@@ -449,17 +680,104 @@ on_keypress_event(App *app, const WinKeyEvent *event)
         case KeyF10:
             term_toggle_trace(app->term);
             return;
+        case KeyF11:
+            app->hud = !app->hud;
+            return;
         }
         break;
     default:
         break;
     }
 
-    if (term_push_input(app->term, event->key, event->mods, event->data, event->len)) {
+    perf_probe_key(event->srvtime);
+    const size_t count = term_push_input(app->term,
+                                         event->key,
+                                         event->mods,
+                                         event->data,
+                                         event->len);
+    perf_probe_input(count);
+    perf_probe_write(term_flush(app->term));
+
+    if (count) {
+        app->key_time = perf_now();
         term_reset_scroll(app->term);
+        // The cursor stays solid while typing
+        app->blink.off = false;
+        app->blink.due = 0;
+        term_set_blink(app->term, true);
     }
 }
 
+// A blinking cursor (per the style the child picked) changes phase on a timer, which is
+// only armed while it's shown. Otherwise, and after key presses, the phase starts over
+void
+update_blink(App *app)
+{
+    if (!app->opts.noblink && term_cursor_blinks(app->term)) {
+        if (!app->blink.due) {
+            app->blink.due = perf_now() + BLINK_INTERVAL;
+        }
+    } else {
+        app->blink.due = 0;
+        if (app->blink.off) {
+            app->blink.off = false;
+            term_set_blink(app->term, true);
+        }
+    }
+}
+
+// Earliest timer to wake up for while there's nothing to draw, or 0 if there is none
+uint64
+next_timer(const App *app)
+{
+    const uint64 a = app->resize.due;
+    const uint64 b = app->blink.due;
+
+    return (a && b) ? MIN(a, b) : MAX(a, b);
+}
+
+// A flood is output arriving faster than it can be shown. Only one screen per refresh
+// is drawn regardless, but during a flood the parser also works in larger chunks and
+// echo doesn't cut frames short. Whatever was parsed in between was fast-forwarded
+void
+update_flood(App *app)
+{
+    const size_t bytes = app->frame_bytes;
+
+    if (!app->flood.active && bytes >= FLOOD_BYTES) {
+        app->flood.active = true;
+        app->flood.start = perf_now();
+        app->flood.bytes = 0;
+        term_set_flood(app->term, true);
+    } else if (app->flood.active && bytes < FLOOD_BYTES / 4) {
+        app->flood.active = false;
+        term_set_flood(app->term, false);
+        dbg_printf("Flood: %.1f MB in %.3f s\n",
+                   app->flood.bytes / 1e6,
+                   (perf_now() - app->flood.start) / 1e9);
+    }
+
+    if (app->flood.active) {
+        app->flood.bytes += bytes;
+        app->flood.total += bytes;
+    }
+}
+
+void
+draw_hud(App *app)
+{
+    char buf[1024];
+    size_t len = perf_format_summary(buf, sizeof(buf), HUD_FRAMES);
+
+    snprintf(buf + len, sizeof(buf) - len,
+             "%-7s %8.1f %8s\n",
+             "ffwd MB",
+             app->flood.total / 1e6,
+             (app->flood.active) ? "flood" : "");
+
+    gfx_draw_overlay(buf, app->fontset);
+}
+
 int app_width(const App *app) { return (app) ? app->width : 0; }
 int app_height(const App *app) { return (app) ? app->height : 0; }
 void *app_fonts(const App *app) { return (app) ? app->fontset : NULL; }
@@ -0,0 +1,380 @@
+/*------------------------------------------------------------------------------*
+ * This file is part of temu
+ * Copyright (C) 2021-2022 Benjamin Harkins
+ *
+ * temu is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *------------------------------------------------------------------------------*/
+
+// Headless renderer benchmark. Draws synthetic frames into an offscreen framebuffer,
+// so it runs without an X server or GPU (e.g. on Mesa's llvmpipe). With -x, the software
+// renderer draws into an image in system memory instead
+
+#include <unistd.h>
+
+#include "utils.h"
+#include "opengl.h"
+#include "color.h"
+#include "cells.h"
+#include "fonts.h"
+#include "gfx_context.h"
+#include "gfx_draw.h"
+#include "gfx_software.h"
+
+#define X_SCENES \
+    X_(ascii,  "Full screen of printable ASCII, rewritten every frame") \
+    X_(sgr,    "Full screen of random 256-color SGR attributes")        \
+    X_(cjk,    "Full screen of CJK ideographs")                         \
+    X_(scroll, "Scrolling by one line per frame")                       \
+    X_(typing, "A single changed cell per frame")
+
+typedef struct Bench Bench;
+
+struct Bench {
+    int cols;
+    int rows;
+    Cell *cells;        // Backing storage (cols * rows), used as a ring by "scroll"
+    const Cell **lines; // Row pointers handed to the renderer
+    Palette palette;
+    Frame frame;
+    uint32 seed;
+};
+
+typedef struct {
+    const char *name;
+    const char *desc;
+    void (*update)(Bench *, int);
+} Scene;
+
+#define X_(name,desc) static void scene_##name(Bench *, int);
+X_SCENES
+#undef X_
+
+static const Scene scenes[] = {
+#define X_(name,desc) { #name, desc, scene_##name },
+    X_SCENES
+#undef X_
+};
+
+static uint32
+rng_next(Bench *bench)
+{
+    // xorshift32
+    uint32 x = bench->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return (bench->seed = x);
+}
+
+static inline Cell *
+get_row(Bench *bench, int row)
+{
+    return &bench->cells[row*bench->cols];
+}
+
+static inline Cell
+make_cell(uint32 ucs4, Color bg, Color fg, uint16 attrs)
+{
+    return (Cell){
+        .ucs4  = ucs4,
+        .bg    = bg,
+        .fg    = fg,
+        .type  = CellTypeNormal,
+        .width = 1,
+        .attrs = attrs
+    };
+}
+
+static void
+damage_all(Bench *bench)
+{
+    arr_clear(bench->frame.damage);
+    arr_push(bench->frame.damage, ((CellRect){ 0, 0, bench->cols, bench->rows }));
+}
+
+static void
+fill_ascii(Bench *bench, Cell *cells, int seed)
+{
+    for (int col = 0; col < bench->cols; col++) {
+        cells[col] = make_cell('!' + (seed + col) % 94,
+                               color_from_key(BACKGROUND),
+                               color_from_key(FOREGROUND),
+                               ATTR_NONE);
+    }
+}
+
+static void
+scene_ascii(Bench *bench, int frame)
+{
+    for (int row = 0; row < bench->rows; row++) {
+        fill_ascii(bench, get_row(bench, row), frame + row);
+    }
+    damage_all(bench);
+}
+
+static void
+scene_sgr(Bench *bench, int frame)
+{
+    static const uint16 attrs[] = {
+        ATTR_NONE, ATTR_BOLD, ATTR_ITALIC, ATTR_BOLD|ATTR_ITALIC, ATTR_INVERT
+    };
+
+    for (int row = 0; row < bench->rows; row++) {
+        Cell *const cells = get_row(bench, row);
+
+        for (int col = 0; col < bench->cols; col++) {
+            const uint32 r = rng_next(bench);
+            cells[col] = make_cell('!' + r % 94,
+                                   color_from_key((r >> 8) % 256),
+                                   color_from_key((r >> 16) % 256),
+                                   attrs[(r >> 24) % LEN(attrs)]);
+        }
+    }
+    damage_all(bench);
+}
+
+static void
+scene_cjk(Bench *bench, int frame)
+{
+    for (int row = 0; row < bench->rows; row++) {
+        Cell *const cells = get_row(bench, row);
+
+        for (int col = 0; col + 1 < bench->cols; col += 2) {
+            cells[col] = make_cell(0x4e00 + rng_next(bench) % 0x5000,
+                                   color_from_key(BACKGROUND),
+                                   color_from_key(FOREGROUND),
+                                   ATTR_NONE);
+            cells[col].width = 2;
+            cells[col+1] = cells[col];
+            cells[col+1].ucs4 = 0;
+            cells[col+1].type = CellTypeDummyWide;
+        }
+    }
+    damage_all(bench);
+}
+
+static void
+scene_scroll(Bench *bench, int frame)
+{
+    // The oldest row is recycled as the new bottom row, and every visible row moves
+    const int head = frame % bench->rows;
+
+    fill_ascii(bench, get_row(bench, uwrap(head - 1, bench->rows)), frame);
+
+    for (int row = 0; row < bench->rows; row++) {
+        bench->lines[row] = get_row(bench, (head + row) % bench->rows);
+    }
+
+    if (frame == 0) {
+        damage_all(bench);
+        return;
+    }
+
+    // Like the terminal reports it: only the new row
+    bench->frame.scroll = 1;
+    arr_clear(bench->frame.damage);
+    arr_push(bench->frame.damage, ((CellRect){ 0, bench->rows - 1, bench->cols, 1 }));
+}
+
+static void
+scene_typing(Bench *bench, int frame)
+{
+    const int col = frame % bench->cols;
+    const int row = bench->rows - 1;
+
+    if (frame == 0) {
+        scene_ascii(bench, frame);
+        return;
+    }
+
+    get_row(bench, row)[col].ucs4 = 'a' + frame % 26;
+
+    arr_clear(bench->frame.damage);
+    arr_push(bench->frame.damage, ((CellRect){ 0, row, bench->cols, 1 }));
+
+    bench->frame.cursor.col = (col + 1) % bench->cols;
+    bench->frame.cursor.row = row;
+}
+
+static void
+bench_reset(Bench *bench, int cwidth, int cheight)
+{
+    memset(bench->cells, 0, bench->cols * bench->rows * sizeof(*bench->cells));
+
+    for (int row = 0; row < bench->rows; row++) {
+        bench->lines[row] = get_row(bench, row);
+    }
+
+    bench->frame.lines   = bench->lines;
+    bench->frame.palette = &bench->palette;
+    bench->frame.cols    = bench->cols;
+    bench->frame.rows    = bench->rows;
+    bench->frame.width   = bench->cols * cwidth;
+    bench->frame.height  = bench->rows * cheight;
+    bench->frame.cursor  = (CursorDesc){ .visible = true };
+    bench->frame.scroll  = 0;
+    bench->seed = 0x9e3779b9;
+}
+
+static void
+run_scene(Bench *bench, const Scene *scene, FontSet *fontset, int nframes, bool software)
+{
+    uint64 cpu = 0;
+    uint64 total = 0;
+    uint64 quads = 0;
+    uint64 bytes = 0;
+
+    for (int i = 0; i < nframes; i++) {
+        scene->update(bench, i);
+
+        const uint64 t0 = timer_nsec(NULL);
+        gfx_clear_rgb1u(bench->palette.bg);
+        gfx_draw_frame(&bench->frame, fontset);
+        const uint64 t1 = timer_nsec(NULL);
+        if (!software) {
+            glFinish();
+        }
+        const uint64 t2 = timer_nsec(NULL);
+
+        GfxStats stats;
+        gfx_get_stats(&stats);
+
+        cpu   += t1 - t0;
+        total += t2 - t0;
+        quads += stats.quads;
+        bytes += stats.bytes;
+    }
+
+    printf("%-8s %10.3f %10.3f %10.1f %10.1f\n",
+           scene->name,
+           cpu / (nframes * 1e6),
+           total / (nframes * 1e6),
+           quads / (double)nframes,
+           bytes / (nframes * 1024.0));
+}
+
+static void
+print_usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-c cols] [-r rows] [-n frames] [-f font] [-s scene] [-x]\n"
+            "\n"
+            "Scenes:\n",
+            argv0);
+    for (uint i = 0; i < LEN(scenes); i++) {
+        fprintf(stderr, "  %-8s %s\n", scenes[i].name, scenes[i].desc);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    int cols = 200;
+    int rows = 60;
+    int nframes = 300;
+    const char *font = NULL;
+    const char *only = NULL;
+    bool software = false;
+
+    for (int opt; (opt = getopt(argc, argv, "c:r:n:f:s:xh")) != -1; ) {
+        switch (opt) {
+        case 'c': cols    = atoi(optarg); break;
+        case 'r': rows    = atoi(optarg); break;
+        case 'n': nframes = atoi(optarg); break;
+        case 'f': font    = optarg; break;
+        case 's': only    = optarg; break;
+        case 'x': software = true; break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (cols <= 0 || rows <= 0 || nframes <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    Gfx *gfx = NULL;
+
+    if (!software) {
+        // Mesa selects its platform from the environment. Without an X server, surfaceless
+        // is the only one guaranteed to work
+        setenv("EGL_PLATFORM", "surfaceless", 0);
+
+        gfx = gfx_create_context(EGL_DEFAULT_DISPLAY);
+        if (!gfx) {
+            err_printf("Failed to create graphics context\n");
+            return 1;
+        }
+    }
+
+    FontSet *fontset = NULL;
+    if (!fontmgr_init(96) ||
+        !(fontset = fontmgr_create_fontset(font)) ||
+        !fontset_init(fontset, software))
+    {
+        err_printf("Failed to load fonts\n");
+        return 1;
+    }
+
+    int cwidth, cheight;
+    fontset_get_metrics(fontset, &cwidth, &cheight, NULL, NULL);
+
+    GfxImage image = { 0 };
+
+    if (software) {
+        image.width  = cols * cwidth;
+        image.height = rows * cheight;
+        image.stride = image.width;
+        image.pixels = xcalloc(image.width * image.height, sizeof(*image.pixels));
+        gfx_set_renderer(GfxRendererSoftware);
+        gfx_software_bind(&image);
+        printf("Software renderer\n");
+    } else {
+        if (!gfx_bind_offscreen(gfx, cols * cwidth, rows * cheight)) {
+            return 1;
+        }
+        gfx_print_info(gfx);
+    }
+
+    Bench bench = { .cols = cols, .rows = rows };
+    bench.cells = xcalloc(cols * rows, sizeof(*bench.cells));
+    bench.lines = xcalloc(rows, sizeof(*bench.lines));
+    palette_init(&bench.palette, false);
+
+    printf("%dx%d cells, %dx%d pixels, %d frames\n\n",
+           cols, rows, cols * cwidth, rows * cheight, nframes);
+    printf("%-8s %10s %10s %10s %10s\n", "scene", "cpu ms", "finish ms", "quads", "upload KB");
+
+    for (uint i = 0; i < LEN(scenes); i++) {
+        if (only && strcmp(only, scenes[i].name) != 0) {
+            continue;
+        }
+        bench_reset(&bench, cwidth, cheight);
+        run_scene(&bench, &scenes[i], fontset, nframes, software);
+    }
+
+    arr_free(bench.frame.damage);
+    FREE(bench.cells);
+    FREE(bench.lines);
+    fontset_destroy(fontset);
+    if (software) {
+        gfx_software_bind(NULL);
+        FREE(image.pixels);
+    } else {
+        gfx_destroy_context(gfx);
+    }
+
+    return 0;
+}
@@ -83,15 +83,27 @@ typedef struct {
     CursorStyle style;
     uint32 color;
     bool visible;
+    bool blink; // The style asks for blinking (visible is false during the off phase)
 } CursorDesc;
 
+// Rectangular region of the screen, in cells
 typedef struct {
-    Cell *cells;
+    int col, row;
+    int cols, rows;
+} CellRect;
+
+// View of the visible screen. The rows point into a snapshot taken by the terminal, which
+// the parser doesn't touch, so a frame stays valid until the next one is generated.
+// Rows outside the damage show what the previous frame showed "scroll" rows below them.
+// The cursor isn't part of the damage, since renderers draw it on top of the cells
+typedef struct {
+    const Cell **lines; // Cells of each visible row (frame->rows entries)
     const Palette *palette;
     int cols, rows;
     int width, height;
     CursorDesc cursor;
-    uint32 time;
+    CellRect *damage; // Regions changed since the previous frame (dynamic array)
+    int scroll;       // Rows the contents moved up since the previous frame (< 0 if down)
 } Frame;
 
 #endif
@@ -46,7 +46,7 @@ typedef struct {
     int32 error;
 } WinEventInfo;
 
-#define EVENTSIZE (56)
+#define EVENTSIZE (64)
 #define EVENTDEFN(...) union { struct { __VA_ARGS__ }; uchar pad__[EVENTSIZE]; }
 
 typedef EVENTDEFN(
@@ -63,6 +63,7 @@ typedef EVENTDEFN(
     uint32 mods;
     uint32 len;
     uchar data[32];
+    uint32 srvtime; // Window server timestamp (ms)
 ) WinKeyEvent;
 
 typedef EVENTDEFN(
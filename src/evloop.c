@@ -0,0 +1,321 @@
+/*------------------------------------------------------------------------------*
+ * This file is part of temu
+ * Copyright (C) 2021-2022 Benjamin Harkins
+ *
+ * temu is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *------------------------------------------------------------------------------*/
+
+// Waits on a small, fixed set of file descriptors plus an optional deadline. On Linux,
+// this is epoll with the deadline armed on a timerfd; elsewhere, plain poll()
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "evloop.h"
+
+#if defined(__linux)
+  #define EVLOOP_EPOLL 1
+  #include <sys/epoll.h>
+  #include <sys/timerfd.h>
+#else
+  #define EVLOOP_EPOLL 0
+  #include <poll.h>
+#endif
+
+#define MAX_WATCHES 8
+
+typedef struct {
+    int fd;
+    uint events;
+    uint revents;
+} Watch;
+
+struct EvLoop {
+    Watch watches[MAX_WATCHES];
+    uint count;
+    uint64 deadline; // Absolute CLOCK_MONOTONIC time (ns), 0 if disarmed
+#if EVLOOP_EPOLL
+    int epfd;
+    int tfd;
+#endif
+};
+
+static Watch *
+find_watch(const EvLoop *loop, int fd)
+{
+    for (uint i = 0; i < loop->count; i++) {
+        if (loop->watches[i].fd == fd) {
+            return (Watch *)&loop->watches[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void
+remove_watch(EvLoop *loop, Watch *watch)
+{
+    *watch = loop->watches[--loop->count];
+}
+
+#if EVLOOP_EPOLL
+
+static inline uint32
+to_epoll(uint events)
+{
+    return ((events & EVLOOP_IN)  ? EPOLLIN  : 0) |
+           ((events & EVLOOP_OUT) ? EPOLLOUT : 0);
+}
+
+static inline uint
+from_epoll(uint32 events)
+{
+    return ((events & EPOLLIN)  ? EVLOOP_IN  : 0) |
+           ((events & EPOLLOUT) ? EVLOOP_OUT : 0) |
+           ((events & EPOLLHUP) ? EVLOOP_HUP : 0) |
+           ((events & EPOLLERR) ? EVLOOP_ERR : 0);
+}
+
+EvLoop *
+evloop_create(void)
+{
+    EvLoop *loop = xcalloc(1, sizeof(*loop));
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+
+    if (loop->epfd < 0 || loop->tfd < 0) {
+        err_printf("Failed to create event loop: %s\n", strerror(errno));
+        goto error;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = loop->tfd };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->tfd, &ev) < 0) {
+        err_printf("epoll_ctl: %s\n", strerror(errno));
+        goto error;
+    }
+
+    return loop;
+error:
+    evloop_destroy(loop);
+    return NULL;
+}
+
+void
+evloop_destroy(EvLoop *loop)
+{
+    if (loop) {
+        if (loop->tfd >= 0) close(loop->tfd);
+        if (loop->epfd >= 0) close(loop->epfd);
+        FREE(loop);
+    }
+}
+
+bool
+evloop_add(EvLoop *loop, int fd, uint events)
+{
+    if (loop->count >= MAX_WATCHES || find_watch(loop, fd)) {
+        return false;
+    }
+
+    struct epoll_event ev = { .events = to_epoll(events), .data.fd = fd };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        err_printf("epoll_ctl: %s\n", strerror(errno));
+        return false;
+    }
+
+    loop->watches[loop->count++] = (Watch){ .fd = fd, .events = events };
+
+    return true;
+}
+
+bool
+evloop_remove(EvLoop *loop, int fd)
+{
+    Watch *watch = find_watch(loop, fd);
+
+    if (!watch) {
+        return false;
+    }
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+        err_printf("epoll_ctl: %s\n", strerror(errno));
+        return false;
+    }
+
+    remove_watch(loop, watch);
+
+    return true;
+}
+
+void
+evloop_set_deadline(EvLoop *loop, uint64 deadline)
+{
+    if (deadline == loop->deadline) {
+        return;
+    }
+
+    // A zero it_value disarms the timer. A deadline in the past fires immediately
+    const struct itimerspec spec = {
+        .it_value = {
+            .tv_sec  = deadline / 1000000000,
+            .tv_nsec = deadline % 1000000000
+        }
+    };
+
+    timerfd_settime(loop->tfd, TFD_TIMER_ABSTIME, &spec, NULL);
+    loop->deadline = deadline;
+}
+
+int
+evloop_wait(EvLoop *loop, bool block)
+{
+    struct epoll_event events[MAX_WATCHES + 1];
+
+    for (uint i = 0; i < loop->count; i++) {
+        loop->watches[i].revents = 0;
+    }
+
+    const int res = epoll_wait(loop->epfd, events, LEN(events), (block) ? -1 : 0);
+    if (res < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    int nready = 0;
+
+    for (int i = 0; i < res; i++) {
+        if (events[i].data.fd == loop->tfd) {
+            // Clear the expiration count. Whether the deadline passed is checked
+            // against the clock, so nothing else to do here
+            uint64 expirations;
+            if (read(loop->tfd, &expirations, sizeof(expirations)) < 0) {
+                ASSERT(errno == EAGAIN);
+            }
+        } else {
+            Watch *watch = find_watch(loop, events[i].data.fd);
+            if (watch) {
+                watch->revents = from_epoll(events[i].events);
+                nready++;
+            }
+        }
+    }
+
+    return nready;
+}
+
+#else // !EVLOOP_EPOLL
+
+EvLoop *
+evloop_create(void)
+{
+    return xcalloc(1, sizeof(EvLoop));
+}
+
+void
+evloop_destroy(EvLoop *loop)
+{
+    FREE(loop);
+}
+
+bool
+evloop_add(EvLoop *loop, int fd, uint events)
+{
+    if (loop->count >= MAX_WATCHES || find_watch(loop, fd)) {
+        return false;
+    }
+
+    loop->watches[loop->count++] = (Watch){ .fd = fd, .events = events };
+
+    return true;
+}
+
+bool
+evloop_remove(EvLoop *loop, int fd)
+{
+    Watch *watch = find_watch(loop, fd);
+
+    if (watch) {
+        remove_watch(loop, watch);
+    }
+
+    return !!watch;
+}
+
+void
+evloop_set_deadline(EvLoop *loop, uint64 deadline)
+{
+    loop->deadline = deadline;
+}
+
+int
+evloop_wait(EvLoop *loop, bool block)
+{
+    struct pollfd pollset[MAX_WATCHES];
+
+    for (uint i = 0; i < loop->count; i++) {
+        pollset[i].fd = loop->watches[i].fd;
+        pollset[i].events = ((loop->watches[i].events & EVLOOP_IN)  ? POLLIN  : 0) |
+                            ((loop->watches[i].events & EVLOOP_OUT) ? POLLOUT : 0);
+        pollset[i].revents = 0;
+        loop->watches[i].revents = 0;
+    }
+
+    int timeout = -1;
+
+    if (!block) {
+        timeout = 0;
+    } else if (loop->deadline) {
+        // Round up, so we don't wake just short of the deadline
+        const uint64 now = timer_nsec(NULL);
+        timeout = (loop->deadline > now) ? (loop->deadline - now + 999999) / 1000000 : 0;
+    }
+
+    const int res = poll(pollset, loop->count, timeout);
+    if (res < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    for (uint i = 0; i < loop->count; i++) {
+        const short ev = pollset[i].revents;
+        loop->watches[i].revents = ((ev & POLLIN)  ? EVLOOP_IN  : 0) |
+                                   ((ev & POLLOUT) ? EVLOOP_OUT : 0) |
+                                   ((ev & POLLHUP) ? EVLOOP_HUP : 0) |
+                                   ((ev & POLLERR) ? EVLOOP_ERR : 0);
+    }
+
+    return res;
+}
+
+#endif // EVLOOP_EPOLL
+
+uint64
+evloop_get_deadline(const EvLoop *loop)
+{
+    return loop->deadline;
+}
+
+bool
+evloop_expired(const EvLoop *loop)
+{
+    return (loop->deadline && timer_nsec(NULL) >= loop->deadline);
+}
+
+uint
+evloop_revents(const EvLoop *loop, int fd)
+{
+    const Watch *watch = find_watch(loop, fd);
+
+    return (watch) ? watch->revents : 0;
+}
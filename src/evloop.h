@@ -0,0 +1,43 @@
+/*------------------------------------------------------------------------------*
+ * This file is part of temu
+ * Copyright (C) 2021-2022 Benjamin Harkins
+ *
+ * temu is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *------------------------------------------------------------------------------*/
+
+#ifndef EVLOOP_H__
+#define EVLOOP_H__
+
+#include "common.h"
+
+typedef struct EvLoop EvLoop;
+
+// Readiness flags
+enum {
+    EVLOOP_IN  = (1 << 0),
+    EVLOOP_OUT = (1 << 1),
+    EVLOOP_HUP = (1 << 2),
+    EVLOOP_ERR = (1 << 3),
+};
+
+EvLoop *evloop_create(void);
+void evloop_destroy(EvLoop *loop);
+bool evloop_add(EvLoop *loop, int fd, uint events);
+bool evloop_remove(EvLoop *loop, int fd);
+void evloop_set_deadline(EvLoop *loop, uint64 deadline);
+uint64 evloop_get_deadline(const EvLoop *loop);
+bool evloop_expired(const EvLoop *loop);
+int evloop_wait(EvLoop *loop, bool block);
+uint evloop_revents(const EvLoop *loop, int fd);
+
+#endif
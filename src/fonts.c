@@ -48,8 +48,23 @@
 #define PIXEL_ALIGN 4
 #define MIN_PADDING 1
 
-#define ATLAS_WIDTH  2048
-#define ATLAS_HEIGHT 2048
+// Size of one layer of the atlas. The atlas starts out with a single layer and doubles
+// its layer count whenever it fills, until it reaches its memory limit
+#define ATLAS_WIDTH  1024
+#define ATLAS_HEIGHT 1024
+#define ATLAS_MAX_BYTES (16 << 20)
+
+// Each layer is split into bands of pages, which are filled with shelves of glyphs and
+// reclaimed as a whole. Shelf heights are rounded up, so similar glyphs share a shelf
+#define ATLAS_PAGES 8
+#define SHELF_ALIGN 4
+
+// Max glyphs in the atlas at once. Their geometry is mirrored in a table texture
+#define ATLAS_TILES 32768
+#define TABLE_WIDTH 256
+
+// Entries in a font's cache of recently used codepoints past Latin-1
+#define GLYPH_CACHE_SIZE 256
 
 #if (ATLAS_WIDTH > GL_MAX_TEXTURE_SIZE) || (ATLAS_HEIGHT > GL_MAX_TEXTURE_SIZE)
   #error "Atlas texture size exceeds OpenGL ES limits"
@@ -57,13 +72,14 @@
 
 typedef struct AtlasNode_ AtlasNode;
 
+// Rendered bitmap, less whatever no cell could show (see font_render_glyph)
 typedef struct {
     AtlasNode *node;
     uint32 idx;
     int width;
     int height;
-    int hbearing;
-    int vbearing;
+    int left; // Offset from the top-left corner of the cell
+    int top;
 } Glyph;
 
 typedef struct {
@@ -72,29 +88,55 @@ typedef struct {
     uint32 ucs4;
 } GlyphMapping;
 
+// Texture of a codepoint, as last returned for it
+typedef struct {
+    bool valid;
+    uint32 ucs4;
+    uint evictions; // Atlas evictions at the time (unused for pinned tiles)
+    int page;       // Page of the tile
+    Texture tex;
+} GlyphCacheEntry;
+
 struct AtlasNode_ {
-    AtlasNode *prev;
-    AtlasNode *next;
+    AtlasNode *next; // Next tile on the same page
     Glyph *glyph;
-    float u;
-    float v;
-    float du;
-    float dv;
+    int page;
+    int x, y;        // Top-left texel
+    int w, h;        // Size in texels
+    bool pinned;     // Keeps its page from being evicted
 };
 
 typedef struct {
-    GLuint tex;       // GPU texture ID
-    AtlasNode *nodes; // Tile data
-    AtlasNode *head;  // LRU tile in queue (pointer into nodes array)
-    AtlasNode *tail;  // MRU tile in queue (pointer into nodes array)
-    int count;        // Current number of used tiles
-    int max;          // Max number of tiles
+    int y;      // Top, relative to the page
+    int height;
+    int width;  // Width taken so far
+} AtlasShelf;
+
+typedef struct {
+    AtlasShelf *shelves; // Shelves from the top down (arr_*)
+    AtlasNode *nodes;    // Tiles on the page
+    int top;             // Height taken by shelves
+    int pinned;          // Number of pinned tiles
+    uint64 used;         // Clock at the last use of any of its tiles
+} AtlasPage;
+
+typedef struct {
+    GLuint tex;       // GPU texture array ID
+    GLuint table;     // GPU copy of the tile geometry (see AtlasLayout)
+    uchar **layers;   // System memory copies, in place of the texture (software rendering)
+    AtlasNode *nodes; // Tile data (ATLAS_TILES entries)
+    uint *free;       // Unused tiles (arr_*)
+    AtlasPage *pages; // Pages of every layer, in order
+    int num_pages;
+    int layer_pages;  // Pages per layer
+    int num_layers;
+    int max_layers;
+    int page_height;
+    int cur;          // Page that was allocated from last
+    int pinned;       // Number of pages with pinned tiles
+    uint64 clock;     // Page use counter
+    uint evictions;   // Number of pages reclaimed since initialization
     int depth;        // Pixel depth of texture
-    int nx, ny;       // Atlas dimension (in tiles)
-    int dx, dy;       // Tile width (in pixels)
-    int lpad;         // Left tile padding
-    int rpad;         // Right tile padding
-    int vpad;         // Top/Bottom tile padding
 } Atlas;
 
 typedef struct {
@@ -115,6 +157,11 @@ typedef struct {
     GlyphMapping *glyphmap;
     uint32 basehash;
 
+    // Lookups in front of the glyph map. Latin-1 is direct-mapped onto pinned tiles,
+    // anything else shares a small direct-mapped cache
+    GlyphCacheEntry latin1[256];
+    GlyphCacheEntry recent[GLYPH_CACHE_SIZE];
+
     uint num_codepoints;
     uint num_glyphs;
     uint num_mapped;
@@ -173,11 +220,6 @@ enum FontHinting {
 #define FCMATRIX_DFL ((FcMatrix){ 1, 0, 0, 1 })
 #define FTMATRIX_DFL ((FT_Matrix){ 0x10000, 0, 0, 0x10000 })
 
-static float norm_x(int);
-static float norm_y(int);
-static int denorm_x(float);
-static int denorm_y(float);
-
 FontSet *fontset_create(FcPattern *pat);
 static void font_create_from_desc(Font *font, struct FontDesc desc);
 static uint32 font_create_glyphmap(Font *font, uint);
@@ -198,11 +240,11 @@ static Atlas *atlas_match_pixelmode(FT_Pixel_Mode pixelmode);
 static Atlas *atlas_match_depth(int depth);
 static AtlasNode *atlas_cache_glyph_bitmap(Atlas *atlas, Glyph *glyph, uchar *bitmap);
 static AtlasNode *atlas_reference_glyph(Atlas *atlas, Glyph *glyph);
-
-inline float norm_x(int x) { return x / (float)ATLAS_WIDTH;  }
-inline float norm_y(int y) { return y / (float)ATLAS_HEIGHT; }
-inline int denorm_x(float x) { return x * ATLAS_WIDTH;  }
-inline int denorm_y(float y) { return y * ATLAS_HEIGHT; }
+static bool atlas_pin_node(Atlas *atlas, AtlasNode *node, bool force);
+static AtlasNode *atlas_alloc_node(Atlas *atlas, int width, int height);
+static int atlas_evict_page(Atlas *atlas);
+static void atlas_add_layers(Atlas *atlas, int count);
+static bool page_alloc_rect(Atlas *atlas, AtlasPage *page, int width, int height, int *x, int *y);
 
 bool
 fontmgr_init(double dpi)
@@ -409,81 +451,71 @@ fontset_create(FcPattern *pat)
 }
 
 bool
-fontset_init(FontSet *set)
+fontset_init(FontSet *set, bool software)
 {
     Atlas *atlas = &set->atlas;
-    Font *basefont = &set->fonts[0];
 
-    // Setup the atlas metrics and nodes
+    // Setup the atlas pages and nodes. A page must fit the tallest glyph
     {
-        const int pitch = ALIGN_UP(basefont->width + 2 * MIN_PADDING, PIXEL_ALIGN);
-
-        atlas->vpad = MIN_PADDING;
-        atlas->lpad = MIN_PADDING;
-        atlas->rpad = pitch - basefont->width - MIN_PADDING;
+        int height = 0;
+        for (int i = 0; i < FontStyleCount; i++) {
+            height = MAX(height, set->fonts[i].height);
+        }
 
         atlas->depth = 1;
+        atlas->page_height = MAX(ATLAS_HEIGHT / ATLAS_PAGES,
+                                 ALIGN_UP(height + MIN_PADDING, SHELF_ALIGN));
+        atlas->layer_pages = ATLAS_HEIGHT / atlas->page_height;
+        if (!atlas->layer_pages) {
+            err_printf("Font height %d exceeds the glyph atlas\n", height);
+            return false;
+        }
+        atlas->max_layers = MAX(1, ATLAS_MAX_BYTES / (ATLAS_WIDTH * ATLAS_HEIGHT * atlas->depth));
+        atlas->nodes = xcalloc(ATLAS_TILES, sizeof(*atlas->nodes));
 
-        atlas->dx = basefont->width + atlas->lpad + atlas->rpad;
-        atlas->dy = basefont->height + 2 * atlas->vpad;
-        atlas->nx = ATLAS_WIDTH / atlas->dx;
-        atlas->ny = ATLAS_HEIGHT / atlas->dy;
-
-        atlas->max = atlas->nx * atlas->ny;
-        atlas->nodes = xcalloc(atlas->max, sizeof(*atlas->nodes));
-
-        const float du = norm_x(atlas->dx);
-        const float dv = norm_y(atlas->dy);
-        const float pl = norm_x(atlas->lpad);
-        const float pr = norm_x(atlas->rpad);
-        const float pv = norm_y(atlas->vpad);
-
-        for (int y = 0, i = 0; y < atlas->ny; y++) {
-            for (int x = 0; x < atlas->nx; x++, i++) {
-                atlas->nodes[i].u = x * du + pl;
-                atlas->nodes[i].v = y * dv + pv;
-                atlas->nodes[i].du = du - pl - pr;
-                atlas->nodes[i].dv = dv - pv - pv;
-            }
+        // Lowest tiles first
+        for (uint i = ATLAS_TILES; i > 0; i--) {
+            arr_push(atlas->free, i - 1);
         }
     }
 
-    // Setup the atlas texture
-    glEnable(GL_CULL_FACE);
-    glEnable(GL_BLEND);
-    glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, PIXEL_ALIGN);
-
-    glGenTextures(1, &atlas->tex);
-    ASSERT(atlas->tex);
-    dbg_printf("Generated texture: %u\n", atlas->tex);
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, atlas->tex);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-    glTexImage2D(
-        GL_TEXTURE_2D,
-        0,
-        GL_R8,
-        ATLAS_WIDTH,
-        ATLAS_HEIGHT,
-        0,
-        GL_RED,
-        GL_UNSIGNED_BYTE,
-        NULL
-    );
+    // Setup the tile geometry table. The software renderer reads the bitmaps directly
+    if (software) {
+        atlas->layers = xcalloc(atlas->max_layers, sizeof(*atlas->layers));
+    } else {
+        glEnable(GL_CULL_FACE);
+        glEnable(GL_BLEND);
+        glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, PIXEL_ALIGN);
+        glActiveTexture(GL_TEXTURE0);
+
+        glGenTextures(1, &atlas->table);
+        ASSERT(atlas->table);
+
+        glBindTexture(GL_TEXTURE_2D, atlas->table);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(
+            GL_TEXTURE_2D,
+            0,
+            GL_RGBA32I,
+            TABLE_WIDTH,
+            ATLAS_TILES / TABLE_WIDTH,
+            0,
+            GL_RGBA_INTEGER,
+            GL_INT,
+            NULL
+        );
+    }
+
+    atlas_add_layers(atlas, 1);
 
     // Finalize initialization for the fonts
     for (int i = 0; i < FontStyleCount; i++) {
         Font *font = &set->fonts[i];
         font_create_glyphmap(font, font->num_codepoints);
         font->glyphs = xcalloc(font->num_glyphs, sizeof(*font->glyphs));
-        font->bitmap = xcalloc(font->max_width * font->max_height, 1);
+        font->bitmap = xcalloc(ALIGN_UP(2 * font->width, PIXEL_ALIGN) * font->height, 1);
 
     }
 
@@ -493,8 +525,13 @@ fontset_init(FontSet *set)
         ASSERT(glyph);
 
         AtlasNode *node = atlas_cache_glyph_bitmap(atlas, glyph, set->fonts[0].bitmap);
-        ASSERT(node && node->glyph == glyph);
-        ASSERT(atlas->count == 1);
+        ASSERT(node == &atlas->nodes[0] && node->glyph == glyph);
+
+        // Every font falls back to this tile, so it must never be evicted
+        if (!atlas_pin_node(atlas, node, true)) {
+            err_printf("Failed to pin the missing glyph\n");
+            return false;
+        }
     }
 
     return true;
@@ -515,6 +552,27 @@ fontset_get_metrics(const FontSet *fontset, int *width, int *height, int *ascent
     return false;
 }
 
+// Any tiles obtained before this value last changed may now refer to a different glyph
+uint
+fontset_get_evictions(const FontSet *set)
+{
+    return set->atlas.evictions;
+}
+
+void
+fontset_get_atlas_layout(const FontSet *set, AtlasLayout *layout)
+{
+    const Atlas *atlas = &set->atlas;
+
+    *layout = (AtlasLayout){
+        .id     = atlas->tex,
+        .table  = atlas->table,
+        .layers = (const uchar *const *)atlas->layers,
+        .width  = ATLAS_WIDTH,
+        .height = ATLAS_HEIGHT
+    };
+}
+
 void
 fontset_destroy(FontSet *set)
 {
@@ -527,7 +585,16 @@ fontset_destroy(FontSet *set)
         FT_Done_Face(font->face);
     }
 
+    for (int i = 0; i < set->atlas.num_pages; i++) {
+        arr_free(set->atlas.pages[i].shelves);
+    }
+    for (int i = 0; set->atlas.layers && i < set->atlas.num_layers; i++) {
+        FREE(set->atlas.layers[i]);
+    }
+    FREE(set->atlas.layers);
+    FREE(set->atlas.pages);
     FREE(set->atlas.nodes);
+    arr_free(set->atlas.free);
     FcFontSetDestroy(set->fcset);
     FT_Done_FreeType(instance.library);
     FcFini();
@@ -796,13 +863,29 @@ query_file_glyph_index(FT_FaceRec *face, const FcCharSet *charset, uint32 ucs4)
 Texture
 fontset_get_glyph_texture(FontSet *set, FontStyle style, uint32 ucs4)
 {
+    Font *font = &set->fonts[style];
+    GlyphCacheEntry *entry;
+
+    // Fast path. Latin-1 entries refer to pinned tiles, so they're good forever. Others
+    // are dropped as soon as the atlas evicts anything, since their tile may be gone
+    if (ucs4 < LEN(font->latin1)) {
+        entry = &font->latin1[ucs4];
+        if (entry->valid) {
+            return entry->tex;
+        }
+    } else {
+        entry = &font->recent[ucs4 % LEN(font->recent)];
+        if (entry->valid && entry->ucs4 == ucs4 && entry->evictions == set->atlas.evictions) {
+            set->atlas.pages[entry->page].used = set->atlas.clock;
+            return entry->tex;
+        }
+    }
+
     // Sanity checks. The missing glyph *must* be canonicalized by this point
     ASSERT(set->fonts[0].glyphs[0].idx == 0);
     ASSERT(set->fonts[0].glyphs[0].node);
     ASSERT(set->atlas.nodes[0].glyph == &set->fonts[0].glyphs[0]);
 
-    Font *font = &set->fonts[style];
-
     uint32 hash = hash_codepoint(font->glyphmap, font->num_glyphs, ucs4);
     ASSERT(hash < font->basehash);
 
@@ -842,13 +925,26 @@ fontset_get_glyph_texture(FontSet *set, FontStyle style, uint32 ucs4)
         node = atlas_cache_glyph_bitmap(atlas, glyph, font->bitmap);
     }
 
-    return (Texture){
-        .id = atlas->tex,
-        .u  = node->u,
-        .v  = node->v,
-        .w  = node->du,
-        .h  = node->dv
+    const Texture tex = {
+        .tile  = node - atlas->nodes,
+        .layer = node->page / atlas->layer_pages,
+        .x     = node->x,
+        .y     = node->y,
+        .w     = node->w,
+        .h     = node->h,
+        .dx    = node->glyph->left,
+        .dy    = node->glyph->top
+    };
+
+    *entry = (GlyphCacheEntry){
+        .valid     = (ucs4 >= LEN(font->latin1) || atlas_pin_node(atlas, node, false)),
+        .ucs4      = ucs4,
+        .evictions = atlas->evictions,
+        .page      = node->page,
+        .tex       = tex
     };
+
+    return tex;
 }
 
 Glyph *
@@ -919,46 +1015,33 @@ font_render_glyph(Font *font, uint32 idx)
     dbg_print_freetype_bitmap(face);
 #endif
 
-    const Atlas *atlas = &font->set->atlas;
+    // Nothing outside the line, or past the widest cell footprint (two cells), is ever
+    // drawn, so it isn't kept either. Renderers clip the rest to the glyph's cell(s)
+    const int left = MAX(slot->bitmap_left, 0);
+    const int top  = MAX(font->ascent - slot->bitmap_top, 0);
+    const int xsrc = left - slot->bitmap_left;
+    const int ysrc = top - (font->ascent - slot->bitmap_top);
+    const int width  = MAX(0, imin((int)slot->bitmap.width - xsrc, 2 * font->width - left));
+    const int height = MAX(0, imin((int)slot->bitmap.rows - ysrc, font->height - top));
+    const int pitch  = ALIGN_UP(width, PIXEL_ALIGN);
 
-    int xsrc = 0, ysrc = 0;
-    int xdst = 0, ydst = 0;
-
-    // Right now, we have to pre-clamp the bitmaps at load time since the atlas doesn't support
-    // variable-sized rectangles yet. This has a negative effect on transformed glyphs.
-    if (slot->bitmap_left < 0) {
-        xsrc = imin(-slot->bitmap_left, font->width);
-    } else {
-        xdst = imin(slot->bitmap_left, font->width);
-    }
-    if (slot->bitmap_top > font->ascent) {
-        ysrc = imin(slot->bitmap_top - font->ascent, font->height);
-    } else {
-        ydst = imin(font->ascent - slot->bitmap_top, font->height);
-    }
-
-    const int width  = imin(slot->bitmap.width - xsrc, font->width - xdst);
-    const int height = imin(slot->bitmap.rows - ysrc, font->height - ydst);
-    ASSERT(width >= 0 && height >= 0);
-
-    memset(font->bitmap, 0, font->max_width * font->max_height);
-
-    const uchar *srcptr = slot->bitmap.buffer + ysrc * slot->bitmap.pitch;
-    uchar *dstptr = font->bitmap + (ydst + atlas->vpad) * atlas->dx;
+    const uchar *srcptr = slot->bitmap.buffer + ysrc * slot->bitmap.pitch + xsrc;
+    uchar *dstptr = font->bitmap;
 
     // Do the copy (alpha-to-alpha for now)
-    for (int y = ydst; y - ydst < height; y++) {
-        memcpy(dstptr + (atlas->lpad + xdst) * atlas->depth, srcptr + xsrc, width);
+    for (int y = 0; y < height; y++) {
+        memcpy(dstptr, srcptr, width);
+        memset(dstptr + width, 0, pitch - width);
         srcptr += slot->bitmap.pitch;
-        dstptr += atlas->dx;
+        dstptr += pitch;
     }
 
-    glyph->idx      = idx;
-    glyph->width    = slot->bitmap.width;
-    glyph->height   = slot->bitmap.rows;
-    glyph->hbearing = -slot->bitmap_left;
-    glyph->vbearing = slot->bitmap_top;
-    glyph->node     = NULL;
+    glyph->idx    = idx;
+    glyph->width  = width;
+    glyph->height = height;
+    glyph->left   = left;
+    glyph->top    = top;
+    glyph->node   = NULL;
 
     return glyph;
 }
@@ -980,29 +1063,10 @@ atlas_match_depth(int depth)
 AtlasNode *
 atlas_reference_glyph(Atlas *atlas, Glyph *glyph)
 {
-    ASSERT(atlas->count);
     ASSERT(glyph && glyph->node);
 
-    AtlasNode *const head = atlas->head;
-    AtlasNode *const tail = atlas->tail;
     AtlasNode *const node = glyph->node;
-
-    // Move the glyph's node to the back of the queue (unless it's the sentinel)
-    if (node != &atlas->nodes[0] && node != tail) {
-        ASSERT(head != tail);
-        ASSERT(head->next);
-
-        if (node == head) {
-            atlas->head = head->next;
-        }
-        atlas->tail = node;
-
-        if (node->prev) node->prev->next = node->next;
-        if (node->next) node->next->prev = node->prev;
-        node->prev = tail;
-        node->next = NULL;
-        tail->next = node;
-    }
+    atlas->pages[node->page].used = ++atlas->clock;
 
     return node;
 }
@@ -1016,89 +1080,287 @@ atlas_cache_glyph_bitmap(Atlas *atlas, Glyph *glyph, uchar *bitmap)
 
     // A null glyph gets cached once and never gets paged out
     // The same node is provided to every font
-    if (!glyph->idx) {
+    if (!glyph->idx && atlas->nodes[0].glyph) {
         node = &atlas->nodes[0];
-        if (!node->glyph) {
-            node->glyph = glyph;
-            atlas->count++;
-        } else {
-            goto assign;
+        goto assign;
+    }
+
+    ASSERT(!glyph->node);
+
+    node = atlas_alloc_node(atlas, glyph->width, glyph->height);
+    ASSERT(glyph->idx || node == &atlas->nodes[0]);
+
+    // Set the new back-reference
+    node->glyph = glyph;
+    atlas->pages[node->page].used = ++atlas->clock;
+
+    const int pitch = ALIGN_UP(glyph->width, PIXEL_ALIGN);
+    const int layer = node->page / atlas->layer_pages;
+
+    if (atlas->layers) {
+        uchar *dst = atlas->layers[layer] + (node->y * ATLAS_WIDTH + node->x) * atlas->depth;
+
+        for (int y = 0; y < node->h; y++) {
+            memcpy(dst, bitmap, node->w * atlas->depth);
+            dst += ATLAS_WIDTH * atlas->depth;
+            bitmap += pitch * atlas->depth;
         }
     } else {
-        ASSERT(!glyph->node);
+        const uint tile = node - atlas->nodes;
+        const GLint texel[4] = {
+            node->x | (node->y << 16),
+            node->w | (node->h << 16),
+            glyph->left | (glyph->top << 16),
+            layer
+        };
 
-        AtlasNode *const head = atlas->head;
-        AtlasNode *const tail = atlas->tail;
+        // The atlas stays bound, on its own target
+        glBindTexture(GL_TEXTURE_2D, atlas->table);
+        glTexSubImage2D(
+            GL_TEXTURE_2D,
+            0,
+            tile % TABLE_WIDTH,
+            tile / TABLE_WIDTH,
+            1,
+            1,
+            GL_RGBA_INTEGER,
+            GL_INT,
+            texel
+        );
+        if (node->w && node->h) {
+            glTexSubImage3D(
+                GL_TEXTURE_2D_ARRAY,
+                0,
+                node->x,
+                node->y,
+                layer,
+                node->w,
+                node->h,
+                1,
+                GL_RED,
+                GL_UNSIGNED_BYTE,
+                bitmap
+            );
+        }
+    }
 
-        atlas->count += !atlas->count;
+assign:
+    ASSERT(node);
+    // Set the new forward-reference
+    glyph->node = node;
 
-        if (atlas->count < atlas->max) {
-            // Add a bitmap to the atlas, push its node to the back of the queue
-            node = &atlas->nodes[atlas->count];
-            if (atlas->count == 1) {
-                // Setup the queue if this is the first "real" glyph
-                ASSERT(!head);
-                ASSERT(!tail);
+    return node;
+}
 
-                atlas->head = node;
-                atlas->tail = node;
+// Takes a free tile and room for a bitmap of the given size. When the pages are full,
+// the atlas grows, and once it can't, the least recently used page is evicted
+AtlasNode *
+atlas_alloc_node(Atlas *atlas, int width, int height)
+{
+    ASSERT(width <= ATLAS_WIDTH && height < atlas->page_height);
 
-                node->prev = NULL;
-                node->next = NULL;
-            } else {
-                // Otherwise, perform a normal DLL insertion
-                atlas->tail = node;
+    if (!arr_count(atlas->free)) {
+        atlas->cur = atlas_evict_page(atlas);
+    }
 
-                tail->next = node;
-                node->prev = tail;
-                node->next = NULL;
+    int x = 0, y = 0;
+
+    // Empty bitmaps take no room, but still need a tile
+    if (width && height) {
+        int i = 0;
+        for (; i < atlas->num_pages; i++) {
+            const int n = (atlas->cur + i) % atlas->num_pages;
+            if (page_alloc_rect(atlas, &atlas->pages[n], width, height, &x, &y)) {
+                atlas->cur = n;
+                break;
             }
-            atlas->count++;
-        } else {
-            ASSERT(atlas->count == atlas->max);
-            // Atlas is full, replace the LRU node and nullify its current forward-reference
-            head->glyph->node = NULL;
-            // Reuse the least recently used node
-            node = head;
-
-            if (head != tail) {
-                ASSERT(atlas->count > 2);
-                ASSERT(!head->prev && head->next);
-
-                atlas->head = head->next;
-                atlas->tail = head;
-
-                head->prev = tail;
-                head->next->prev = NULL;
-                head->next = NULL;
-                tail->next = head;
+        }
+        if (i == atlas->num_pages) {
+            if (atlas->num_layers < atlas->max_layers) {
+                atlas->cur = atlas->num_pages;
+                atlas_add_layers(atlas, imin(atlas->num_layers,
+                                             atlas->max_layers - atlas->num_layers));
+            } else {
+                atlas->cur = atlas_evict_page(atlas);
+            }
+            if (!page_alloc_rect(atlas, &atlas->pages[atlas->cur], width, height, &x, &y)) {
+                ASSERT(false);
             }
         }
-        // Set the new back-reference
-        node->glyph = glyph;
     }
 
-    glBindTexture(GL_TEXTURE_2D, atlas->tex);
-    glTexSubImage2D(
-        GL_TEXTURE_2D,
-        0,
-        (denorm_x(node->u) - atlas->lpad) * atlas->depth,
-        (denorm_y(node->v) - atlas->vpad) * atlas->depth,
-        atlas->dx * atlas->depth,
-        atlas->dy * atlas->depth,
-        GL_RED,
-        GL_UNSIGNED_BYTE,
-        bitmap
-    );
+    AtlasPage *const page = &atlas->pages[atlas->cur];
+    AtlasNode *const node = &atlas->nodes[arr_pop(atlas->free)];
 
-assign:
-    ASSERT(node);
-    // Set the new forward-reference
-    glyph->node = node;
+    *node = (AtlasNode){
+        .next = page->nodes,
+        .page = atlas->cur,
+        .x    = x,
+        .y    = y,
+        .w    = width,
+        .h    = height
+    };
+    page->nodes = node;
 
     return node;
 }
 
+// Finds room on a page, on the first shelf of the right height that isn't full yet.
+// A new shelf is started below the others otherwise
+bool
+page_alloc_rect(Atlas *atlas, AtlasPage *page, int width, int height, int *x, int *y)
+{
+    const int pw = width + MIN_PADDING;
+    const int ph = ALIGN_UP(height + MIN_PADDING, SHELF_ALIGN);
+    const int base = (page - atlas->pages) % atlas->layer_pages * atlas->page_height;
+    AtlasShelf *shelf = NULL;
+
+    for (uint i = 0; i < arr_count(page->shelves); i++) {
+        if (page->shelves[i].height == ph && page->shelves[i].width + pw <= ATLAS_WIDTH) {
+            shelf = &page->shelves[i];
+            break;
+        }
+    }
+
+    if (!shelf) {
+        if (page->top + ph > atlas->page_height) {
+            return false;
+        }
+        arr_push(page->shelves, ((AtlasShelf){ .y = page->top, .height = ph }));
+        shelf = &page->shelves[arr_count(page->shelves) - 1];
+        page->top += ph;
+    }
+
+    *x = shelf->width;
+    *y = base + shelf->y;
+    shelf->width += pw;
+
+    return true;
+}
+
+// Reclaims the least recently used page that holds tiles, none of them pinned
+int
+atlas_evict_page(Atlas *atlas)
+{
+    int lru = -1;
+
+    for (int i = 0; i < atlas->num_pages; i++) {
+        const AtlasPage *page = &atlas->pages[i];
+        if (!page->pinned && page->nodes && (lru < 0 || page->used < atlas->pages[lru].used)) {
+            lru = i;
+        }
+    }
+    ASSERT(lru >= 0);
+
+    AtlasPage *const page = &atlas->pages[lru];
+
+    for (AtlasNode *node = page->nodes; node; node = node->next) {
+        // Nullify the glyph's forward-reference, it'll be cached again on its next use
+        node->glyph->node = NULL;
+        node->glyph = NULL;
+        arr_push(atlas->free, node - atlas->nodes);
+    }
+
+    arr_clear(page->shelves);
+    page->nodes = NULL;
+    page->top = 0;
+    atlas->evictions++;
+
+    return lru;
+}
+
+// Appends empty layers, and their pages. A texture array can't be resized in place, so
+// the GPU copy is moved into a new one with the old layers copied over
+void
+atlas_add_layers(Atlas *atlas, int count)
+{
+    const int num_layers = atlas->num_layers + count;
+    ASSERT(count > 0 && num_layers <= atlas->max_layers);
+
+    if (atlas->layers) {
+        for (int i = atlas->num_layers; i < num_layers; i++) {
+            atlas->layers[i] = xcalloc(ATLAS_WIDTH * ATLAS_HEIGHT, atlas->depth);
+        }
+    } else {
+        GLuint tex;
+        glGenTextures(1, &tex);
+        ASSERT(tex);
+
+        glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage3D(
+            GL_TEXTURE_2D_ARRAY,
+            0,
+            GL_R8,
+            ATLAS_WIDTH,
+            ATLAS_HEIGHT,
+            num_layers,
+            0,
+            GL_RED,
+            GL_UNSIGNED_BYTE,
+            NULL
+        );
+
+        // Each old layer is read through a framebuffer, which is the only way to copy
+        // between textures in GLES 3.0. The caller's read framebuffer is restored after
+        if (atlas->tex) {
+            GLint prev;
+            GLuint fbo;
+            glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &prev);
+            glGenFramebuffers(1, &fbo);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+
+            for (int i = 0; i < atlas->num_layers; i++) {
+                glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, atlas->tex, 0, i);
+                glCopyTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, 0, 0, ATLAS_WIDTH, ATLAS_HEIGHT);
+            }
+
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, prev);
+            glDeleteFramebuffers(1, &fbo);
+            glDeleteTextures(1, &atlas->tex);
+        }
+
+        atlas->tex = tex;
+    }
+
+    const int num_pages = num_layers * atlas->layer_pages;
+    atlas->pages = xrealloc(atlas->pages, num_pages, sizeof(*atlas->pages));
+    memset(&atlas->pages[atlas->num_pages], 0,
+           (num_pages - atlas->num_pages) * sizeof(*atlas->pages));
+    atlas->num_pages = num_pages;
+    atlas->num_layers = num_layers;
+
+    dbg_printf("Glyph atlas has %d layers (%d max)\n", atlas->num_layers, atlas->max_layers);
+}
+
+// Keeps a cached glyph's tile resident, by never evicting its page. At most half the
+// pages can hold pinned tiles, which leaves plenty to cycle through when the atlas is full.
+// A forced pin ignores that limit, as long as another page is left to evict
+bool
+atlas_pin_node(Atlas *atlas, AtlasNode *node, bool force)
+{
+    ASSERT(node->glyph && node->glyph->node == node);
+
+    AtlasPage *const page = &atlas->pages[node->page];
+    const int limit = (force) ? atlas->max_layers * atlas->layer_pages - 1
+                              : atlas->num_pages / 2;
+
+    if (node->pinned) {
+        return true;
+    } else if (!page->pinned && atlas->pinned >= limit) {
+        return false;
+    }
+
+    atlas->pinned += !page->pinned;
+    page->pinned++;
+    node->pinned = true;
+
+    return true;
+}
+
 void
 dbg_print_freetype_bitmap(const FT_FaceRec *face)
 {
@@ -37,20 +37,36 @@ typedef enum {
 
 typedef struct FontSet_ FontSet;
 
+// Location of a glyph's bitmap in the atlas, and where it goes relative to the top-left
+// corner of its cell. Renderers clip it to the cells the glyph occupies
 typedef struct {
-    uint id;
-    float u;
-    float v;
-    float w;
-    float h;
+    uint tile;  // Index of the glyph's entry in the atlas' geometry table
+    int layer;  // Layer of the texture array
+    int x, y;   // Top-left texel
+    int w, h;   // Size in texels (possibly empty)
+    int dx, dy;
 } Texture;
 
+// Glyph atlas textures. Glyphs are packed at their own size, so the GL renderer looks up
+// a tile's geometry in the table: one RGBA32I texel per tile, holding (x | y << 16,
+// w | h << 16, dx | dy << 16, layer) as in Texture, at column (tile % width) and row
+// (tile / width). Growing the atlas replaces the texture array, and so changes the id
+typedef struct {
+    uint id;                    // Texture array object (0 when kept in system memory)
+    uint table;                 // Tile geometry texture object (0 when kept in system memory)
+    const uchar *const *layers; // Coverage bitmaps in system memory, one byte per texel
+    int width;                  // Layer width in pixels
+    int height;                 // Layer height in pixels
+} AtlasLayout;
+
 bool fontmgr_init(double);
 FontSet *fontmgr_create_fontset(const char *);
 FontSet *fontmgr_create_fontset_from_file(const char *);
 void fontset_destroy(FontSet *set);
-bool fontset_init(FontSet *);
+bool fontset_init(FontSet *, bool);
 Texture fontset_get_glyph_texture(FontSet *, FontStyle, uint32);
 bool fontset_get_metrics(const FontSet *, int *, int *, int *, int *);
+uint fontset_get_evictions(const FontSet *);
+void fontset_get_atlas_layout(const FontSet *, AtlasLayout *);
 
 #endif
@@ -20,6 +20,8 @@
 #include "gfx_context.h"
 #include "gfx_renderer.h"
 
+#include <EGL/eglext.h>
+
 typedef struct {
     EGLSurface id;
     EGLNativeWindowType win;
@@ -35,12 +37,55 @@ struct Gfx {
         EGLint minor;
     } ver;
     GfxSurface surface;
+    struct {
+        GLuint fbo;
+        GLuint rbo;
+    } offscreen;
+    struct {
+        bool buffer_age;
+        PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC swap_with_damage;
+    } ext;
 };
 
 static struct {
     Gfx gfx;
 } globals;
 
+static bool
+has_extension(const char *list, const char *name)
+{
+    const size_t len = strlen(name);
+
+    for (const char *str = list; str && (str = strstr(str, name)); str += len) {
+        if ((str == list || str[-1] == ' ') && (str[len] == ' ' || !str[len])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Both flavors of swap-with-damage have the same signature and semantics
+static void
+query_extensions(Gfx *gfx)
+{
+    const char *const list = eglQueryString(gfx->dpy, EGL_EXTENSIONS);
+
+    gfx->ext.buffer_age = has_extension(list, "EGL_EXT_buffer_age");
+
+    if (has_extension(list, "EGL_KHR_swap_buffers_with_damage")) {
+        gfx->ext.swap_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)
+            eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+    } else if (has_extension(list, "EGL_EXT_swap_buffers_with_damage")) {
+        gfx->ext.swap_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)
+            eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+    }
+
+    dbg_printf("Buffer age: %s, swap with damage: %s\n",
+               (gfx->ext.buffer_age) ? "yes" : "no",
+               (gfx->ext.swap_with_damage) ? "yes" : "no");
+}
+
 Gfx *
 gfx_create_context(EGLNativeDisplayType dpy)
 {
@@ -58,6 +103,8 @@ gfx_create_context(EGLNativeDisplayType dpy)
     gfx->surface.id  = EGL_NO_SURFACE;
     gfx->surface.win = 0;
 
+    query_extensions(gfx);
+
     eglBindAPI(EGL_OPENGL_ES_API);
 
     gfx->ctx = eglCreateContext(
@@ -85,7 +132,7 @@ gfx_create_context(EGLNativeDisplayType dpy)
         err_printf("eglMakeCurrent failed to bind context\n");
         goto bail;
     }
-    if (!gfx_renderer_init()) {
+    if (!gfx_renderer_init(gfx)) {
         err_printf("Failed to initialize renderer\n");
         goto bail;
     }
@@ -103,6 +150,11 @@ gfx_destroy_context(Gfx *gfx)
         return;
     }
 
+    if (gfx->ctx && gfx->offscreen.fbo) {
+        glDeleteFramebuffers(1, &gfx->offscreen.fbo);
+        glDeleteRenderbuffers(1, &gfx->offscreen.rbo);
+    }
+
     eglMakeCurrent(gfx->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 
     if (gfx->surface.id != EGL_NO_SURFACE) {
@@ -191,6 +243,39 @@ gfx_bind_surface(Gfx *gfx, EGLNativeWindowType win)
     return true;
 }
 
+// Redirects rendering to an offscreen framebuffer of the given size, for use without a
+// window system (i.e. a surfaceless or pbuffer-less display). Can be called again to
+// resize the framebuffer
+bool
+gfx_bind_offscreen(Gfx *gfx, uint width, uint height)
+{
+    if (!gfx || !gfx->ctx) {
+        return false;
+    }
+
+    if (!gfx->offscreen.fbo) {
+        glGenFramebuffers(1, &gfx->offscreen.fbo);
+        glGenRenderbuffers(1, &gfx->offscreen.rbo);
+    }
+
+    glBindRenderbuffer(GL_RENDERBUFFER, gfx->offscreen.rbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindFramebuffer(GL_FRAMEBUFFER, gfx->offscreen.fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER,
+                              GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER,
+                              gfx->offscreen.rbo);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        err_printf("Incomplete offscreen framebuffer\n");
+        return false;
+    }
+
+    gfx_renderer_resize(width, height);
+
+    return true;
+}
+
 bool
 gfx_get_size(const Gfx *gfx, int *r_width, int *r_height)
 {
@@ -227,11 +312,38 @@ gfx_set_vsync(const Gfx *gfx, bool enable)
     }
 }
 
+// Number of frames since the contents of the back buffer were drawn, or 0 if they're
+// undefined. An offscreen framebuffer always holds the previous frame
+int
+gfx_get_buffer_age(const Gfx *gfx)
+{
+    if (!gfx || !gfx->ctx) {
+        return 0;
+    } else if (gfx->surface.id == EGL_NO_SURFACE) {
+        return (gfx->offscreen.fbo) ? 1 : 0;
+    }
+
+    EGLint age = 0;
+    if (gfx->ext.buffer_age) {
+        eglQuerySurface(gfx->dpy, gfx->surface.id, EGL_BUFFER_AGE_EXT, &age);
+    }
+
+    return age;
+}
+
 void
 gfx_swap_buffers(const Gfx *gfx)
 {
     if (gfx && gfx->surface.id) {
-        eglSwapBuffers(gfx->dpy, gfx->surface.id);
+        EGLint rect[4];
+        if (!gfx_renderer_end_frame(rect)) {
+            return; // Nothing changed since the last swap
+        }
+        if (gfx->ext.swap_with_damage) {
+            gfx->ext.swap_with_damage(gfx->dpy, gfx->surface.id, rect, 1);
+        } else {
+            eglSwapBuffers(gfx->dpy, gfx->surface.id);
+        }
     }
 }
 
@@ -28,8 +28,10 @@ Gfx *gfx_create_context(EGLNativeDisplayType dpy);
 void gfx_destroy_context(Gfx *gfx);
 EGLint gfx_get_native_visual(Gfx *gfx);
 bool gfx_bind_surface(Gfx *gfx, EGLNativeWindowType win);
+bool gfx_bind_offscreen(Gfx *gfx, uint width, uint height);
 bool gfx_get_size(const Gfx *gfx, int *r_width, int *r_height);
 void gfx_resize(Gfx *gfx, uint width, uint height);
+int gfx_get_buffer_age(const Gfx *gfx);
 void gfx_swap_buffers(const Gfx *gfx);
 void gfx_print_info(const Gfx *gfx);
 void gfx_set_debug_object(const void *obj);
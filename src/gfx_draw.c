@@ -0,0 +1,95 @@
+/*------------------------------------------------------------------------------*
+ * This file is part of temu
+ * Copyright (C) 2021-2022 Benjamin Harkins
+ *
+ * temu is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *------------------------------------------------------------------------------*/
+
+// Forwards drawing to the renderer selected at runtime
+
+#include "utils.h"
+#include "gfx_draw.h"
+#include "gfx_renderer.h"
+
+static struct {
+    const GfxBackend *backend;
+} globals = {
+    .backend = &gfx_backend_gl
+};
+
+void
+gfx_set_renderer(GfxRenderer renderer)
+{
+    switch (renderer) {
+    case GfxRendererGL:
+        globals.backend = &gfx_backend_gl;
+        break;
+    case GfxRendererSoftware:
+        globals.backend = &gfx_backend_software;
+        break;
+    }
+}
+
+void
+gfx_clear_rgb1u(uint32 rgb)
+{
+    globals.backend->clear(rgb & 0xffffff);
+}
+
+void
+gfx_clear_rgb3u(uint8 r, uint8 g, uint8 b)
+{
+    gfx_clear_rgb1u(PACK_4x8(0, r, g, b));
+}
+
+void
+gfx_clear_rgb3f(float r, float g, float b)
+{
+    gfx_clear_rgb3u(r * 255.f + 0.5f,
+                    g * 255.f + 0.5f,
+                    b * 255.f + 0.5f);
+}
+
+void
+gfx_draw_frame(const Frame *frame, FontSet *fontset)
+{
+    globals.backend->draw_frame(frame, fontset);
+}
+
+// Redraws only the cursor of the frame that was drawn last, e.g. after it changed its
+// blink phase. Nothing else about the frame may have changed
+void
+gfx_draw_cursor(const Frame *frame, FontSet *fontset)
+{
+    globals.backend->draw_cursor(frame, fontset);
+}
+
+void
+gfx_draw_overlay(const char *text, FontSet *fontset)
+{
+    globals.backend->draw_overlay(text, fontset);
+}
+
+// The window's contents were lost (e.g. part of it was exposed), so the next frame is
+// presented in full, even if nothing in it changed
+void
+gfx_expose(void)
+{
+    globals.backend->expose();
+}
+
+void
+gfx_get_stats(GfxStats *stats)
+{
+    globals.backend->get_stats(stats);
+}
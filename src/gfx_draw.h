@@ -22,10 +22,29 @@
 #include "cells.h"
 #include "fonts.h"
 
+// Work done by the most recent call to gfx_draw_frame()
+typedef struct {
+    uint quads;   // Instances drawn
+    uint rows;    // Grid rows rebuilt
+    uint uploads; // Buffer upload calls
+    size_t bytes; // Instance data uploaded
+    uint draws;   // Draw calls
+} GfxStats;
+
+typedef enum {
+    GfxRendererGL,       // GLES renderer, draws to the current EGL surface (default)
+    GfxRendererSoftware, // CPU rasterizer, draws to the bound image (see gfx_software.h)
+} GfxRenderer;
+
+void gfx_set_renderer(GfxRenderer);
 void gfx_clear_rgb1u(uint32 rgb);
 void gfx_clear_rgb3u(uint8 r, uint8 g, uint8 b);
 void gfx_clear_rgb3f(float r, float g, float b);
 void gfx_draw_frame(const Frame *, FontSet *);
+void gfx_draw_cursor(const Frame *, FontSet *);
+void gfx_draw_overlay(const char *, FontSet *);
+void gfx_expose(void);
+void gfx_get_stats(GfxStats *);
 
 #endif
 
@@ -20,65 +20,202 @@
 #include "vector.h"
 #include "gfx_renderer.h"
 #include "gfx_draw.h"
+#include "perf.h"
 
 #include <math.h>
 
 typedef struct GfxDraw_ GfxDraw; // NOTE(ben): temporary
 typedef struct GfxQuad_ GfxQuad;
 typedef struct GfxQuadAttr_ GfxQuadAttr;
+typedef struct GfxLayer_ GfxLayer;
+typedef struct GfxStream_ GfxStream;
+typedef struct GfxBuffer_ GfxBuffer;
+
+// Number of previous frames whose damage is remembered. A back buffer that's any older
+// than this is redrawn in full
+#define MAX_BUFFER_AGE 4
+
+// Number of instance buffers cycled through. Each frame writes to the buffer that was
+// drawn from longest ago, so uploads don't wait on draws that are still in flight
+#define NUM_BUFFERS 3
+
+// Each frame is drawn in two passes: merged runs of non-default background color,
+// followed by blended glyphs for the cells that actually have ink
+enum {
+    LAYER_BG,
+    LAYER_GLYPH,
+    NUM_LAYERS
+};
+
+// CPU side of a pass. Each row's instances are built in a scratch area, then packed
+// back-to-back so the whole pass can be drawn with a single call
+struct GfxLayer_ {
+    GfxQuad *scratch; // Instances of each row (cols entries per row)
+    int *counts;      // Number of instances in each row
+    int *offsets;     // Offset of each row in the packed array (rows + 1 entries)
+    GfxQuad *packed;  // Instances of all rows, in order
+};
+
+// GPU side of a pass
+struct GfxStream_ {
+    GLuint vao;
+    GLuint vbo;
+    uint32 *stamps; // Grid row stamps as of the last upload (0 = invalid)
+    int *offsets;   // Row offsets as of the last upload
+    int rows;       // Number of stamps/offsets
+    int capacity;   // Allocated instances
+    int first;      // Instance the attributes point at
+};
+
+struct GfxBuffer_ {
+    GfxStream streams[NUM_LAYERS];
+};
+
+// Rows of the surface, in pixels from the top
+typedef struct {
+    int top;
+    int bottom;
+} GfxSpan;
 
 struct GfxDraw_ {
+    Gfx *gfx;
     int width;
     int height;
 
     GLuint prog;
-    GLuint vao;
-    GLuint vbo;
-    GfxQuad *quads;
+    GLuint target; // Framebuffer that's presented (0 for the window surface)
+
+    // Frames are drawn into a persistent copy of the previous frame, and the damaged part
+    // is then copied to the target. A whole-screen scroll blits one copy into the other,
+    // shifted, so the rows that only moved aren't drawn again
+    struct {
+        GLuint fbo[2];
+        GLuint rbo[2];
+        uint cur; // Copy holding the most recent frame
+    } canvas;
+
+    // Partial presents. A back buffer holds the frame presented "age" swaps ago, so only
+    // the damage of that frame and every frame since has to be copied
+    struct {
+        uint32 color;                    // Clear color of the current frame
+        bool pending;                    // Cleared, but not drawn yet
+        int age;                         // Age of the back buffer (0 = undefined)
+        GfxSpan damage;                  // Damage of the current frame
+        GfxSpan history[MAX_BUFFER_AGE]; // Damage of the previous frames, newest first
+        int count;                       // Valid history entries
+        GfxSpan overlay;                 // Rows covered by the last overlay
+        bool reset;                      // Surface was resized or exposed, all damaged
+    } present;
+
+    GfxBuffer buffers[NUM_BUFFERS];
+    uint next; // Buffer to use for the next frame
+
+    // Text drawn on top of the grid, rebuilt and re-uploaded every time
+    struct {
+        GLuint vao;
+        GLuint vbo;
+        GfxQuad *quads; // arr_*
+    } overlay;
+
+    // Cursor, drawn on top of the grid after the canvas is presented. It's never part of
+    // the canvas, so moving or blinking it only copies its old row again
+    struct {
+        GLuint vao;
+        GLuint vbo;
+        bool visible;
+        int col;
+        int row;
+        CursorStyle style;
+        GfxSpan span; // Rows covered when it was last drawn
+    } cursor;
+
+    // Persistent cell grid, mirrored in each instance buffer. Rows are stored in a ring
+    // of slots, so a scroll rotates the ring instead of moving any instances
+    struct {
+        GfxLayer layers[NUM_LAYERS];
+        uint8 *dirty;   // Slots that need to be rebuilt
+        uint8 *redraw;  // Rows that need to be drawn into the canvas
+        uint32 *stamps; // Per-slot stamp, updated whenever a slot is rebuilt
+        uint32 stamp;   // Last stamp issued
+        int base;       // Slot of the top row
+        int cols;
+        int rows;
+        int cwidth;
+        int cheight;
+        uint evictions; // Glyph cache evictions at the last rebuild
+    } grid;
 
     struct {
         GLuint projection;
+        GLuint origin;
+        GLuint cell;
+        GLuint grid;
+        GLuint atlas_size;
     } uniforms;
+
+    GLuint atlas; // Texture object the atlas uniforms were derived from
+
+    GfxStats stats;
+
+    // Palette colors, resolved in the vertex shader
+    struct {
+        GLuint tex;
+        uint32 table[NUM_COLORS]; // Copy of the uploaded table
+        bool valid;
+    } palette;
 };
 
-#define GLENUM_F GL_FLOAT
-#define GLENUM_I GL_INT
-#define GLENUM_U GL_UNSIGNED_INT
+#define GLENUM_U16 GL_UNSIGNED_SHORT
+#define GLENUM_U32 GL_UNSIGNED_INT
+#define CTYPE_U16  uint16
+#define CTYPE_U32  uint32
 
+// Instance data for a single cell, packed into 16 bytes. The screen rectangle and
+// texture coordinates are reconstructed in the vertex shader from the grid position
+// and the tile's entry in the atlas geometry table. Colors are encoded as either a palette key or an RGB
+// value (see encode_color)
 #define X_QUAD_ATTRS \
-    X_(4, F, dst) /* Screen bbox      */ \
-    X_(4, F, src) /* Texture bbox     */ \
-    X_(1, I, tex) /* Texture ID       */ \
-    X_(4, F, bg)  /* Background color */ \
-    X_(4, F, fg)  /* Foreground color */ \
+    X_(2, U16, 0, cell)  /* Grid column, slot       */ \
+    X_(2, U16, 0, glyph) /* Atlas tile index, flags */ \
+    X_(2, U32, 0, color) /* Background, foreground  */ \
 
 struct GfxQuad_ {
-#define X_(n,t,v) Vec##n##t v;
+#define X_(n,t,norm,v) CTYPE_##t v[n];
     X_QUAD_ATTRS
 #undef X_
 };
 
+static_assert(sizeof(GfxQuad) == 16, "Unexpected instance size");
+
 struct GfxQuadAttr_ {
     GLenum type;
     int count;
+    bool normalized;
     size_t stride;
     uintptr_t offset;
 };
 
 static const GfxQuadAttr quad_attrs[] = {
-#define X_(n,t,v)                      \
-    {                                  \
-        .type   = GLENUM_##t,          \
-        .count  = (n),                 \
-        .stride = sizeof(GfxQuad),     \
-        .offset = offsetof(GfxQuad, v) \
+#define X_(n,t,norm,v)                     \
+    {                                      \
+        .type       = GLENUM_##t,          \
+        .count      = (n),                 \
+        .normalized = (norm),              \
+        .stride     = sizeof(GfxQuad),     \
+        .offset     = offsetof(GfxQuad, v) \
     },
     X_QUAD_ATTRS
 #undef X_
 };
 #undef X_QUAD_ATTRS
 
-#define MAX_QUADS (1024)
+// Instance glyph flags
+#define QUAD_GLYPH  (1 << 0) // Sample the tile (otherwise the cell is background only)
+#define QUAD_INVERT (1 << 1) // Swap the foreground and background colors
+#define QUAD_WIDE   (1 << 2) // The glyph covers two cells
+
+// Tag bit for encoded colors that refer to a palette entry
+#define COLOR_KEY (1 << 24)
 
 static struct {
     GfxDraw draw;
@@ -87,17 +224,28 @@ static struct {
 static const char shader_vert[] =
 "#version 300 es\n"
 "\n"
-"layout (location = 0) in vec4 a_dst;\n"
-"layout (location = 1) in vec4 a_src;\n"
-"layout (location = 2) in int  a_tex;\n"
-"layout (location = 3) in vec4 a_bg;\n"
-"layout (location = 4) in vec4 a_fg;\n"
+"layout (location = 0) in uvec2 a_cell;\n"
+"layout (location = 1) in uvec2 a_glyph;\n"
+"layout (location = 2) in uvec2 a_color;\n"
 "\n"
-"flat out int tex;\n"
-"out vec2 pos;\n"
+"flat out uint flags;\n"
+"out vec3 pos;\n"
 "out vec4 bg;\n"
 "out vec4 fg;\n"
 "uniform mat4 u_projection;\n"
+"uniform vec2 u_origin;\n"
+"uniform vec2 u_cell;\n"
+"uniform uvec2 u_grid;\n"
+"uniform vec2 u_atlas_size;\n"
+"uniform sampler2D u_palette;\n"
+"uniform highp isampler2D u_glyphs;\n"
+"\n"
+"vec4 get_color(uint val) {\n"
+"    if ((val & 0x1000000u) != 0u) {\n"
+"        return texelFetch(u_palette, ivec2(val & 0xffffu, 0), 0);\n"
+"    }\n"
+"    return vec4((uvec3(val) >> uvec3(16, 8, 0)) & 0xffu, 255u) / 255.0;\n"
+"}\n"
 "\n"
 "vec2 get_corner(vec4 rect) {\n"
 "    return rect.xy + rect.zw * vec2(gl_VertexID >> 1, gl_VertexID & 1);\n"
@@ -108,11 +256,30 @@ static const char shader_vert[] =
 "}\n"
 "\n"
 "void main() {\n"
-"    pos = get_corner(a_src);\n"
-"    tex = a_tex;\n"
-"    bg  = a_bg;\n"
-"    fg  = a_fg;\n"
-"    set_position(get_corner(a_dst));\n"
+"    flags = a_glyph.y;\n"
+"    int invert = int((a_glyph.y >> 1) & 1u);\n"
+"    bg = get_color(a_color[invert]);\n"
+"    fg = get_color(a_color[invert ^ 1]);\n"
+"    // Slots are a ring of rows, starting at the top row's slot\n"
+"    uint row = (a_cell.y + u_grid.x - u_grid.y) % u_grid.x;\n"
+"    vec2 cell = u_origin + vec2(a_cell.x, row) * u_cell;\n"
+"    if ((a_glyph.y & 1u) != 0u) {\n"
+"        // The glyph's bitmap, placed relative to the cell and clipped to its cells\n"
+"        int cols = textureSize(u_glyphs, 0).x;\n"
+"        ivec4 tile = texelFetch(u_glyphs, ivec2(int(a_glyph.x) % cols, int(a_glyph.x) / cols), 0);\n"
+"        vec2 texel = vec2(tile.x & 0xffff, tile.x >> 16);\n"
+"        vec2 size = vec2(tile.y & 0xffff, tile.y >> 16);\n"
+"        vec2 offset = vec2(tile.z & 0xffff, tile.z >> 16);\n"
+"        vec2 lo = max(offset, vec2(0.0));\n"
+"        vec2 hi = min(offset + size, u_cell * vec2(((a_glyph.y & 4u) != 0u) ? 2.0 : 1.0, 1.0));\n"
+"        vec2 point = get_corner(vec4(lo, max(hi - lo, vec2(0.0))));\n"
+"        pos = vec3((texel + point - offset) / u_atlas_size, tile.w);\n"
+"        set_position(cell + point);\n"
+"    } else {\n"
+"        // Background runs store their length (in cells) in place of the tile index\n"
+"        pos = vec3(0.0);\n"
+"        set_position(get_corner(vec4(cell, u_cell * vec2(a_glyph.x, 1.0))));\n"
+"    }\n"
 "}\n"
 ;
 
@@ -121,97 +288,602 @@ static const char shader_frag[] =
 "\n"
 "precision highp float;\n"
 "\n"
-"flat in int tex;\n"
-"in vec2 pos;\n"
+"flat in uint flags;\n"
+"in vec3 pos;\n"
 "in vec4 bg;\n"
 "in vec4 fg;\n"
 "\n"
 "out vec4 color;\n"
 "\n"
-"uniform sampler2D samplers[4];\n"
-"\n"
-"float get_alpha(int idx) {\n"
-"    // Hopefully temporary workaround for undefined behavior stemming from indexing into a\n"
-"    // uniform sampler array. Actively produces visible artifacts on my AMD card.\n"
-"    switch (idx) {\n"
-"#define SAMPLE(n) texture(samplers[(n)], pos).r\n"
-"    case 1:  return SAMPLE(0);\n"
-"    case 2:  return SAMPLE(1);\n"
-"    case 3:  return SAMPLE(2);\n"
-"    case 4:  return SAMPLE(3);\n"
-"    case 5:  return SAMPLE(0);\n"
-"    case 6:  return SAMPLE(1);\n"
-"    case 7:  return SAMPLE(2);\n"
-"    case 8:  return SAMPLE(3);\n"
-"    case 9:  return SAMPLE(0);\n"
-"    case 10: return SAMPLE(1);\n"
-"    case 11: return SAMPLE(2);\n"
-"    case 12: return SAMPLE(3);\n"
-"    case 13: return SAMPLE(0);\n"
-"    case 14: return SAMPLE(1);\n"
-"    case 15: return SAMPLE(2);\n"
-"    case 16: return SAMPLE(3);\n"
-"#undef SAMPLE\n"
-"    default: return 0.0;\n"
-"    }\n"
-"}\n"
+"uniform highp sampler2DArray u_atlas;\n"
 "\n"
 "void main() {\n"
-"    color = mix(bg, fg, get_alpha(tex));\n"
+"    if ((flags & 1u) != 0u) {\n"
+"        color = vec4(fg.rgb, fg.a * texture(u_atlas, pos).r);\n"
+"    } else {\n"
+"        color = bg;\n"
+"    }\n"
 "}\n"
 ;
 
 static inline GfxDraw *get_draw(void) { return &globals.draw; }
 
-static inline Vec4F
-unpack_argb(uint32 argb)
+// Palette keys are resolved by the shader, so palette changes don't touch the grid
+static inline uint32
+encode_color(Color color)
 {
-    return VEC4F(
-        ((argb & 0x00ff0000) >> 16) / 255.f,
-        ((argb & 0x0000ff00) >>  8) / 255.f,
-        ((argb & 0x000000ff) >>  0) / 255.f,
-        1.f
-    );
+    return (color.resolved) ? (color.val & 0xffffff) : (COLOR_KEY | color.key);
 }
 
-void
-gfx_clear_rgb3f(float r, float g, float b)
+static inline bool
+span_empty(GfxSpan span)
 {
-    glClearColor(r, g, b, 1.f);
+    return (span.top >= span.bottom);
+}
+
+static inline GfxSpan
+span_union(GfxSpan a, GfxSpan b)
+{
+    if (span_empty(a)) return b;
+    if (span_empty(b)) return a;
+
+    return (GfxSpan){ MIN(a.top, b.top), MAX(a.bottom, b.bottom) };
+}
+
+// Starts a frame. The clear itself is deferred to gfx_draw_frame(), which only clears
+// what it redraws
+static void
+clear(uint32 rgb)
+{
+    GfxDraw *const draw = get_draw();
+
+    draw->present.color = rgb;
+    draw->present.pending = true;
+    draw->present.age = gfx_get_buffer_age(draw->gfx);
+    draw->present.damage = (GfxSpan){ 0 };
+}
+
+static void
+set_clear_color(uint32 rgb)
+{
+    glClearColor(((rgb >> 16) & 0xff) / 255.f,
+                 ((rgb >>  8) & 0xff) / 255.f,
+                 ((rgb >>  0) & 0xff) / 255.f,
+                 1.f);
+}
+
+// Clears a band of the current canvas, and restricts drawing to it
+static void
+canvas_clear(GfxDraw *draw, GfxSpan span)
+{
+    span.top = MAX(span.top, 0);
+    span.bottom = MIN(span.bottom, draw->height);
+
+    if (span_empty(span)) {
+        return;
+    } else if (span.top == 0 && span.bottom == draw->height) {
+        glDisable(GL_SCISSOR_TEST);
+    } else {
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(0, draw->height - span.bottom, draw->width, span.bottom - span.top);
+    }
+
+    set_clear_color(draw->present.color);
     glClear(GL_COLOR_BUFFER_BIT);
+}
+
+// Copies the grid's pixels, shifted by whole rows (up if shift > 0), into the other
+// canvas, which becomes the current one. The rows that scrolled in are left for the
+// caller to redraw
+static void
+canvas_scroll(GfxDraw *draw, int shift, int top)
+{
+    const int src = top + MAX(shift, 0) * draw->grid.cheight;
+    const int dst = top + MAX(-shift, 0) * draw->grid.cheight;
+    const int height = MIN((draw->grid.rows - abs(shift)) * draw->grid.cheight,
+                           draw->height - MAX(src, dst));
+    const uint next = draw->canvas.cur ^ 1;
+
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, draw->canvas.fbo[draw->canvas.cur]);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw->canvas.fbo[next]);
 
+    if (height > 0) {
+        glBlitFramebuffer(0, draw->height - src - height, draw->width, draw->height - src,
+                          0, draw->height - dst - height, draw->width, draw->height - dst,
+                          GL_COLOR_BUFFER_BIT,
+                          GL_NEAREST);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, draw->canvas.fbo[next]);
+    draw->canvas.cur = next;
+
+    // The border around the grid didn't move
+    canvas_clear(draw, (GfxSpan){ 0, top });
+    canvas_clear(draw, (GfxSpan){ top + draw->grid.rows * draw->grid.cheight, draw->height });
 }
 
-void
-gfx_clear_rgb3u(uint8 r, uint8 g, uint8 b)
+// Copies the part of the canvas that's out of date in the target's back buffer, given
+// the damage of the current frame, and leaves the target bound
+static void
+canvas_present(GfxDraw *draw, GfxSpan damage)
 {
-    gfx_clear_rgb3f(r / 255.f,
-                    g / 255.f,
-                    b / 255.f);
+    GfxSpan span = damage;
+    const int age = draw->present.age;
+
+    if (age > 0 && age - 1 <= draw->present.count) {
+        for (int i = 0; i < age - 1; i++) {
+            span = span_union(span, draw->present.history[i]);
+        }
+    } else {
+        span = (GfxSpan){ 0, draw->height };
+    }
+
+    span.top = MAX(span.top, 0);
+    span.bottom = MIN(span.bottom, draw->height);
+
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, draw->canvas.fbo[draw->canvas.cur]);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw->target);
+
+    if (!span_empty(span)) {
+        glBlitFramebuffer(0, draw->height - span.bottom, draw->width, draw->height - span.top,
+                          0, draw->height - span.bottom, draw->width, draw->height - span.top,
+                          GL_COLOR_BUFFER_BIT,
+                          GL_NEAREST);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, draw->target);
+
+    draw->present.damage = span_union(draw->present.damage, damage);
+    draw->present.pending = false;
 }
 
-void
-gfx_clear_rgb1u(uint32 rgb)
+// Fills the target with the clear color when no frame was drawn since the clear. The
+// next frame is presented in full, since the target no longer matches the canvas
+static void
+clear_target(GfxDraw *draw)
 {
-    gfx_clear_rgb3u((rgb >> 16) & 0xff,
-                    (rgb >>  8) & 0xff,
-                    (rgb >>  0) & 0xff);
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, draw->target);
+    set_clear_color(draw->present.color);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    draw->present.damage = (GfxSpan){ 0, draw->height };
+    draw->present.pending = false;
+    draw->present.reset = true;
 }
 
 static void
-draw_prepare(GLuint prog, GLuint vao)
+draw_prepare(GLuint prog)
 {
     glUseProgram(prog);
-    glBindVertexArray(vao);
 }
 
+// Updates the texture lookup uniforms, and binds the tile geometry, if the glyph atlas changed
 static void
-draw_quads(const GfxQuad *quads, int count)
+atlas_prepare(GfxDraw *draw, const FontSet *fontset)
 {
-    if (count > 0) {
-        glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(*quads), quads);
-        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+    AtlasLayout layout;
+    fontset_get_atlas_layout(fontset, &layout);
+
+    if (layout.id != draw->atlas) {
+        glUniform2f(draw->uniforms.atlas_size, layout.width, layout.height);
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, layout.table);
+        glActiveTexture(GL_TEXTURE0);
+        draw->atlas = layout.id;
+    }
+}
+
+// Uploads the palette to its lookup texture if it changed since the last frame. Returns
+// true if it did
+static bool
+palette_prepare(GfxDraw *draw, const Palette *palette)
+{
+    if (draw->palette.valid && !memcmp(draw->palette.table, palette->table, sizeof(palette->table))) {
+        return false;
+    }
+
+    uint8 texels[NUM_COLORS][4];
+
+    for (uint i = 0; i < NUM_COLORS; i++) {
+        texels[i][0] = (palette->table[i] >> 16) & 0xff;
+        texels[i][1] = (palette->table[i] >>  8) & 0xff;
+        texels[i][2] = (palette->table[i] >>  0) & 0xff;
+        texels[i][3] = 0xff;
+    }
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, draw->palette.tex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, NUM_COLORS, 1, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+    glActiveTexture(GL_TEXTURE0);
+
+    memcpy(draw->palette.table, palette->table, sizeof(palette->table));
+    draw->palette.valid = true;
+
+    return true;
+}
+
+// Reallocates the cell grid if the frame's geometry changed. Returns true if the
+// existing contents are still usable
+static bool
+grid_prepare(GfxDraw *draw, const Frame *frame)
+{
+    const int cwidth  = frame->width / frame->cols;
+    const int cheight = frame->height / frame->rows;
+
+    if (frame->cols == draw->grid.cols &&
+        frame->rows == draw->grid.rows &&
+        cwidth == draw->grid.cwidth &&
+        cheight == draw->grid.cheight)
+    {
+        return true;
+    }
+
+    const int count = frame->cols * frame->rows;
+
+    for (uint i = 0; i < NUM_LAYERS; i++) {
+        GfxLayer *const layer = &draw->grid.layers[i];
+        layer->scratch = xrealloc(layer->scratch, count, sizeof(*layer->scratch));
+        layer->packed  = xrealloc(layer->packed, count, sizeof(*layer->packed));
+        layer->counts  = xrealloc(layer->counts, frame->rows, sizeof(*layer->counts));
+        layer->offsets = xrealloc(layer->offsets, frame->rows + 1, sizeof(*layer->offsets));
+        memset(layer->counts, 0, frame->rows * sizeof(*layer->counts));
+        memset(layer->offsets, 0, (frame->rows + 1) * sizeof(*layer->offsets));
+    }
+
+    draw->grid.dirty = xrealloc(draw->grid.dirty, frame->rows, sizeof(*draw->grid.dirty));
+    draw->grid.redraw = xrealloc(draw->grid.redraw, frame->rows, sizeof(*draw->grid.redraw));
+    draw->grid.stamps = xrealloc(draw->grid.stamps, frame->rows, sizeof(*draw->grid.stamps));
+    draw->grid.cols = frame->cols;
+    draw->grid.rows = frame->rows;
+    draw->grid.cwidth = cwidth;
+    draw->grid.cheight = cheight;
+    draw->grid.base = 0;
+
+    glUniform2f(draw->uniforms.cell, cwidth, cheight);
+
+    return false;
+}
+
+static inline bool
+has_ink(const Cell *cell)
+{
+    switch (cell->ucs4) {
+    case 0:
+    case ' ':
+    case 0x00a0: // No-break space
+    case 0x3000: // Ideographic space
+        return false;
+    default:
+        return !(cell->attrs & ATTR_INVISIBLE);
+    }
+}
+
+static inline int
+grid_slot(const GfxDraw *draw, int row)
+{
+    return (draw->grid.base + row) % draw->grid.rows;
+}
+
+static inline uint32
+quad_bg(const GfxQuad *quad)
+{
+    return quad->color[(quad->glyph[1] & QUAD_INVERT) ? 1 : 0];
+}
+
+// Converts one row of cells into background runs and glyph quads, stored in the given slot
+static void
+grid_build_row(GfxDraw *draw, const Frame *frame, FontSet *fontset, int row, int slot)
+{
+    GfxLayer *const bgs = &draw->grid.layers[LAYER_BG];
+    GfxLayer *const glyphs = &draw->grid.layers[LAYER_GLYPH];
+    GfxQuad *const runs = &bgs->scratch[slot*draw->grid.cols];
+    GfxQuad *const quads = &glyphs->scratch[slot*draw->grid.cols];
+    const Cell *const cells = frame->lines[row];
+
+    int nruns = 0;
+    int nquads = 0;
+
+    for (int col = 0; col < frame->cols; col++) {
+        const Cell *const cell = &cells[col];
+        GfxQuad quad = { .cell = { col, slot } };
+
+        if (cell->ucs4) {
+            quad.glyph[1] = (cell->attrs & ATTR_INVERT) ? QUAD_INVERT : 0;
+            quad.color[0] = encode_color(cell->bg);
+            quad.color[1] = encode_color(cell->fg);
+        } else {
+            // Never written
+            quad.color[0] = COLOR_KEY | BACKGROUND;
+            quad.color[1] = COLOR_KEY | FOREGROUND;
+        }
+
+        // The default background is already painted by the clear. Anything else
+        // either extends the previous run or starts a new one
+        const uint32 bg = quad_bg(&quad);
+
+        if (bg != (COLOR_KEY|BACKGROUND)) {
+            GfxQuad *const prev = (nruns) ? &runs[nruns-1] : NULL;
+
+            if (prev && prev->cell[0] + prev->glyph[0] == col && quad_bg(prev) == bg) {
+                prev->glyph[0]++;
+            } else {
+                runs[nruns] = quad;
+                runs[nruns].glyph[0] = 1;
+                nruns++;
+            }
+        }
+
+        if (has_ink(cell)) {
+            const Texture tex = fontset_get_glyph_texture(
+                fontset,
+                cell->attrs & (ATTR_BOLD|ATTR_ITALIC),
+                cell->ucs4
+            );
+
+            quad.glyph[0] = tex.tile;
+            quad.glyph[1] |= QUAD_GLYPH | ((cell->width == 2) ? QUAD_WIDE : 0);
+            quads[nquads++] = quad;
+        }
+    }
+
+    bgs->counts[slot] = nruns;
+    glyphs->counts[slot] = nquads;
+}
+
+// Packs the slots of each pass back-to-back. Only rebuilt slots and slots that moved
+// because of a preceding slot's instance count are copied
+static void
+grid_pack(GfxDraw *draw)
+{
+    for (uint i = 0; i < NUM_LAYERS; i++) {
+        GfxLayer *const layer = &draw->grid.layers[i];
+        int offset = 0;
+
+        for (int row = 0; row < draw->grid.rows; row++) {
+            if (draw->grid.dirty[row] || layer->offsets[row] != offset) {
+                memcpy(&layer->packed[offset],
+                       &layer->scratch[row*draw->grid.cols],
+                       layer->counts[row] * sizeof(*layer->packed));
+                layer->offsets[row] = offset;
+            }
+            offset += layer->counts[row];
+        }
+
+        layer->offsets[draw->grid.rows] = offset;
+    }
+}
+
+// Brings an instance stream up to date with its layer, growing it if necessary. Slots
+// that were rebuilt or moved since the last upload are sent in contiguous ranges, so
+// a full frame is a single upload
+static void
+stream_sync(GfxDraw *draw, GfxStream *stream, const GfxLayer *layer)
+{
+    const int rows = draw->grid.rows;
+    const int count = draw->grid.cols * rows;
+
+    glBindVertexArray(stream->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, stream->vbo);
+
+    if (count > stream->capacity) {
+        stream->capacity = MAX(count, 2 * stream->capacity);
+        glBufferData(GL_ARRAY_BUFFER,
+                     stream->capacity * sizeof(*layer->packed),
+                     NULL,
+                     GL_DYNAMIC_DRAW);
+        stream->rows = 0;
+    }
+    if (stream->rows != rows) {
+        stream->stamps = xrealloc(stream->stamps, rows, sizeof(*stream->stamps));
+        stream->offsets = xrealloc(stream->offsets, rows, sizeof(*stream->offsets));
+        stream->rows = rows;
+        memset(stream->stamps, 0, rows * sizeof(*stream->stamps));
+        memset(stream->offsets, 0, rows * sizeof(*stream->offsets));
+    }
+
+#define STALE(r) (stream->stamps[(r)] != draw->grid.stamps[(r)] || \
+                  stream->offsets[(r)] != layer->offsets[(r)])
+    for (int row = 0, end; row < rows; row = end) {
+        for (end = row + 1; STALE(row) && end < rows; end++) {
+            if (!STALE(end)) break;
+        }
+        if (!STALE(row)) {
+            continue;
+        }
+        if (row == 0 && end == rows) {
+            // Orphan the old store rather than writing over data that may be in use
+            glBufferData(GL_ARRAY_BUFFER,
+                         stream->capacity * sizeof(*layer->packed),
+                         NULL,
+                         GL_DYNAMIC_DRAW);
+        }
+
+        const int offset = layer->offsets[row];
+        const int length = layer->offsets[end] - offset;
+
+        if (length > 0) {
+            glBufferSubData(GL_ARRAY_BUFFER,
+                            offset * sizeof(*layer->packed),
+                            length * sizeof(*layer->packed),
+                            &layer->packed[offset]);
+            draw->stats.uploads++;
+            draw->stats.bytes += length * sizeof(*layer->packed);
+        }
+
+        memcpy(&stream->stamps[row], &draw->grid.stamps[row], (end - row) * sizeof(*stream->stamps));
+        memcpy(&stream->offsets[row], &layer->offsets[row], (end - row) * sizeof(*stream->offsets));
+    }
+#undef STALE
+}
+
+// Points the instance attributes of the bound vertex array at the given instance
+static void
+bind_instances(int first)
+{
+    for (uint i = 0; i < LEN(quad_attrs); i++) {
+        const GfxQuadAttr *qa = &quad_attrs[i];
+        gl_define_attr(i, qa->count, qa->type, qa->normalized, qa->stride,
+                       qa->offset + first * sizeof(GfxQuad));
+    }
+}
+
+// Draws each pass's instances for a range of slots. Instances never reach outside their
+// row, so the passes of different ranges can't overlap
+static void
+draw_slots(GfxDraw *draw, GfxBuffer *buf, int first, int end)
+{
+    for (uint i = 0; i < NUM_LAYERS; i++) {
+        const GfxLayer *const layer = &draw->grid.layers[i];
+        GfxStream *const stream = &buf->streams[i];
+        const int offset = layer->offsets[first];
+        const int count = layer->offsets[end] - offset;
+
+        if (count > 0) {
+            glBindVertexArray(stream->vao);
+            if (stream->first != offset) {
+                glBindBuffer(GL_ARRAY_BUFFER, stream->vbo);
+                bind_instances(offset);
+                stream->first = offset;
+            }
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+            draw->stats.quads += count;
+            draw->stats.draws++;
+        }
+    }
+}
+
+// Draws a range of rows, which occupy up to two ranges of slots
+static void
+draw_rows(GfxDraw *draw, GfxBuffer *buf, int row, int end)
+{
+    const int first = grid_slot(draw, row);
+    const int last = first + (end - row);
+
+    draw_slots(draw, buf, first, MIN(last, draw->grid.rows));
+    if (last > draw->grid.rows) {
+        draw_slots(draw, buf, 0, last - draw->grid.rows);
+    }
+}
+
+// Fills a rectangle of the target (top-down pixel coordinates) with a solid color
+static void
+target_fill(GfxDraw *draw, int x, int y, int width, int height, uint32 rgb)
+{
+    if (width > 0 && height > 0) {
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(x, draw->height - y - height, width, height);
+        set_clear_color(rgb);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glDisable(GL_SCISSOR_TEST);
+    }
+}
+
+// Draws the cursor over its cell on the target, covering both cells of a wide glyph.
+// A block (any other style) is the cell with the default colors swapped. The other
+// shapes are drawn in the foreground color over the cell as presented
+static void
+cursor_draw(GfxDraw *draw, const Frame *frame, FontSet *fontset)
+{
+    const CursorDesc *const cur = &frame->cursor;
+    const Cell *const cell = &frame->lines[cur->row][cur->col];
+    const int ncells = (cell->width == 2 && cur->col + 1 < frame->cols) ? 2 : 1;
+    const int cwidth = draw->grid.cwidth;
+    const int cheight = draw->grid.cheight;
+    const int x = MAX(0, draw->width - frame->width) / 2 + cur->col * cwidth;
+    const int y = MAX(0, draw->height - frame->height) / 2 + cur->row * cheight;
+    const int width = ncells * cwidth;
+    const uint32 rgb = frame->palette->fg & 0xffffff;
+
+    switch (cur->style) {
+    case CursorStyleUnderscore: {
+        const int size = MAX(1, cheight / 8);
+        target_fill(draw, x, y + cheight - size, width, size, rgb);
+        return;
+    }
+    case CursorStyleBar:
+        target_fill(draw, x, y, MAX(1, cwidth / 8), cheight, rgb);
+        return;
+    case CursorStyleOutline:
+        target_fill(draw, x, y, width, 1, rgb);
+        target_fill(draw, x, y + cheight - 1, width, 1, rgb);
+        target_fill(draw, x, y, 1, cheight, rgb);
+        target_fill(draw, x + width - 1, y, 1, cheight, rgb);
+        return;
+    default:
+        break;
+    }
+
+    GfxQuad quads[2] = {
+        {
+            .cell  = { cur->col, grid_slot(draw, cur->row) },
+            .glyph = { ncells, 0 },
+            .color = { COLOR_KEY|FOREGROUND, COLOR_KEY|BACKGROUND }
+        }
+    };
+    uint count = 1;
+
+    if (has_ink(cell)) {
+        const Texture tex = fontset_get_glyph_texture(
+            fontset,
+            cell->attrs & (ATTR_BOLD|ATTR_ITALIC),
+            cell->ucs4
+        );
+        quads[count] = quads[0];
+        quads[count].glyph[0] = tex.tile;
+        quads[count].glyph[1] = QUAD_GLYPH | ((cell->width == 2) ? QUAD_WIDE : 0);
+        count++;
     }
+
+    glBindVertexArray(draw->cursor.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, draw->cursor.vbo);
+    glBufferData(GL_ARRAY_BUFFER, count * sizeof(*quads), quads, GL_STREAM_DRAW);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+    draw->stats.quads += count;
+    draw->stats.draws++;
+}
+
+// Presents the canvas, given the damage of the current frame, and draws the cursor on
+// top. The last overlay and cursor are erased by copying their rows again
+static void
+present_frame(GfxDraw *draw, const Frame *frame, FontSet *fontset, GfxSpan damage)
+{
+    const CursorDesc *const cur = &frame->cursor;
+    const bool visible = (cur->visible &&
+                          cur->col >= 0 && cur->col < frame->cols &&
+                          cur->row >= 0 && cur->row < frame->rows);
+    const int top = MAX(0, draw->height - frame->height) / 2;
+    const GfxSpan span = (visible)
+                       ? (GfxSpan){ top + cur->row * draw->grid.cheight,
+                                    top + (cur->row + 1) * draw->grid.cheight }
+                       : (GfxSpan){ 0 };
+
+    if (visible != draw->cursor.visible ||
+        cur->col != draw->cursor.col ||
+        cur->row != draw->cursor.row ||
+        cur->style != draw->cursor.style)
+    {
+        damage = span_union(damage, draw->cursor.span);
+        damage = span_union(damage, span);
+    }
+
+    damage = span_union(damage, draw->present.overlay);
+    draw->present.overlay = (GfxSpan){ 0 };
+
+    canvas_present(draw, damage);
+
+    // Drawing over a cursor that's already there is harmless, so it's always drawn
+    if (visible) {
+        cursor_draw(draw, frame, fontset);
+    }
+
+    draw->cursor.visible = visible;
+    draw->cursor.col = cur->col;
+    draw->cursor.row = cur->row;
+    draw->cursor.style = cur->style;
+    draw->cursor.span = span;
 }
 
 /* TODO(ben):
@@ -221,96 +893,263 @@ draw_quads(const GfxQuad *quads, int count)
  * Glyph texture querying is also a mess - but that's part of a more complicated
  * architectural problem
  */
-#include <ctype.h>
-void
-gfx_draw_frame(const Frame *frame, FontSet *fontset)
+static void
+draw_frame(const Frame *frame, FontSet *fontset)
 {
     GfxDraw *const draw = get_draw();
 
-    if (!frame || !fontset) {
+    if (!frame || !fontset || frame->cols <= 0 || frame->rows <= 0 || !draw->canvas.fbo[0]) {
         return;
     }
 
-    uint idx = 0;
+    memset(&draw->stats, 0, sizeof(draw->stats));
+    draw_prepare(draw->prog);
+    atlas_prepare(draw, fontset);
 
-    draw_prepare(draw->prog, draw->vao);
+    const bool recolor = palette_prepare(draw, frame->palette);
+    const bool reset = !grid_prepare(draw, frame);
+    const int rows = draw->grid.rows;
+    const int cheight = draw->grid.cheight;
 
-    // Cursor coordinates
-    const int ccol = frame->cursor.col;
-    const int crow = frame->cursor.row;
     // Pixel border offset
-    const int ox = MAX(0, draw->width - frame->width) / 2;
-    const int oy = MAX(0, draw->height - frame->height) / 2;
-    // Pixel advance per cell
-    const int dx = frame->width / frame->cols;
-    const int dy = frame->height / frame->rows;
-
-    GfxQuad *const quads = draw->quads;
-
-    for (int row = 0; row < frame->rows; row++) {
-        if (idx + frame->cols > MAX_QUADS) {
-            draw_quads(quads, idx);
-            idx = 0;
+    const int top = MAX(0, draw->height - frame->height) / 2;
+    glUniform2f(draw->uniforms.origin, MAX(0, draw->width - frame->width) / 2, top);
+
+    // A scroll rotates the grid's slots and shifts the canvas. The slots of rows that
+    // scrolled in are rebuilt, like damaged rows
+    const int shift = (!reset && abs(frame->scroll) < rows) ? frame->scroll : 0;
+    draw->grid.base = uwrap(draw->grid.base + shift, rows);
+    glUniform2ui(draw->uniforms.grid, rows, draw->grid.base);
+
+    // Only the damaged rows are rebuilt, unless the grid was reset or cached glyphs were
+    // paged out since the last rebuild (which invalidates texture coordinates in clean
+    // rows). Only the damaged rows are redrawn, unless the canvas can't be reused
+    bool full = (reset ||
+                 shift != frame->scroll ||
+                 draw->grid.evictions != fontset_get_evictions(fontset));
+    const bool repaint = reset || recolor || draw->present.reset || shift != frame->scroll;
+
+    memset(draw->grid.dirty, full, rows);
+    memset(draw->grid.redraw, repaint, rows);
+    for (uint i = 0; i < arr_count(frame->damage); i++) {
+        const CellRect rect = frame->damage[i];
+        for (int row = rect.row; row < rect.row + rect.rows; row++) {
+            draw->grid.dirty[grid_slot(draw, row)] = 1;
+            draw->grid.redraw[row] = 1;
+        }
+    }
+
+    // Rows whose pixels scrolled in from outside the surface are redrawn as well
+    const int visible = MIN(rows, (draw->height - top) / cheight);
+    for (int row = 0; shift && row < rows; row++) {
+        const int src = row + shift;
+        if (src < 0 || src >= rows) {
+            draw->grid.dirty[grid_slot(draw, row)] = 1;
+        }
+        if (src < 0 || src >= visible) {
+            draw->grid.redraw[row] = 1;
         }
+    }
 
-        const Cell *const cells = &frame->cells[row*frame->cols];
-        int col;
+    // If building the dirty rows evicts glyphs, the clean rows must be rebuilt as well.
+    // We only retry once - if the cache is thrashing, there's nothing left to gain
+    const uint64 t_build = perf_now();
+    for (int pass = 0; pass < 2; pass++) {
+        draw->grid.evictions = fontset_get_evictions(fontset);
+        for (int slot = 0; slot < rows; slot++) {
+            if (draw->grid.dirty[slot]) {
+                grid_build_row(draw, frame, fontset, uwrap(slot - draw->grid.base, rows), slot);
+                draw->grid.stamps[slot] = ++draw->grid.stamp;
+                draw->stats.rows++;
+            }
+        }
+        if (full || draw->grid.evictions == fontset_get_evictions(fontset)) {
+            break;
+        }
+        memset(draw->grid.dirty, (full = true), rows);
+    }
 
-        for (col = 0; col < frame->cols && cells[col].ucs4; col++, idx++) {
-            const Cell cell = cells[col];
-            const Texture tex = fontset_get_glyph_texture(
-                fontset,
-                cell.attrs & (ATTR_BOLD|ATTR_ITALIC),
-                cell.ucs4
-            );
+    grid_pack(draw);
+    perf_add(PERF_GLYPHS, t_build);
 
-            // FIXME(ben):
-            // Screen coords arent't normalized but texture coords are. Pretty weird
-            quads[idx].dst = VEC4F(ox + col * dx, oy + row * dy, dx, dy);
-            quads[idx].src = VEC4F(tex.u, tex.v, tex.w, tex.h);
-            quads[idx].tex = tex.id;
+    GfxBuffer *const buf = &draw->buffers[draw->next];
+    draw->next = (draw->next + 1) % NUM_BUFFERS;
 
-            const uint32 bg = palette_query_color(frame->palette, cell.bg);
-            const uint32 fg = palette_query_color(frame->palette, cell.fg);
+    const uint64 t_upload = perf_now();
+    for (uint i = 0; i < NUM_LAYERS; i++) {
+        stream_sync(draw, &buf->streams[i], &draw->grid.layers[i]);
+    }
+    perf_add(PERF_UPLOAD, t_upload);
 
-            if (cell.attrs & ATTR_INVERT) {
-                quads[idx].bg = unpack_argb(fg);
-                quads[idx].fg = unpack_argb(bg);
-            } else {
-                quads[idx].bg = unpack_argb(bg);
-                quads[idx].fg = unpack_argb(fg);
+    // Pixels that changed on screen since the previous frame. Rebuilding rows for evicted
+    // glyphs doesn't change anything
+    GfxSpan damage = { 0 };
+
+    glBindFramebuffer(GL_FRAMEBUFFER, draw->canvas.fbo[draw->canvas.cur]);
+
+    if (repaint) {
+        canvas_clear(draw, (GfxSpan){ 0, draw->height });
+        damage = (GfxSpan){ 0, draw->height };
+        draw->present.reset = false;
+    } else if (shift) {
+        canvas_scroll(draw, shift, top);
+        damage = span_union(damage, (GfxSpan){ top, top + rows * cheight });
+    }
+
+    for (int row = 0, end; row < rows; row = end) {
+        for (end = row + 1; draw->grid.redraw[row] && end < rows && draw->grid.redraw[end]; end++);
+        if (draw->grid.redraw[row]) {
+            const GfxSpan span = { top + row * cheight, top + end * cheight };
+            if (!repaint) {
+                canvas_clear(draw, span);
             }
+            draw_rows(draw, buf, row, end);
+            damage = span_union(damage, span);
         }
+    }
 
-        if (row == crow && frame->cursor.visible && ccol < frame->cols) {
-            // Write the cursor cell in this row
-            GfxQuad *quad;
+    present_frame(draw, frame, fontset, damage);
+}
 
-            if (col > ccol) {
-                // Cursor cell was already seen
-                quad = &quads[idx-(col-ccol)];
+static void
+draw_cursor(const Frame *frame, FontSet *fontset)
+{
+    GfxDraw *const draw = get_draw();
+
+    // The canvas must hold this frame already
+    if (!frame || !fontset || !draw->grid.rows || !draw->canvas.fbo[0] || draw->present.reset) {
+        return;
+    }
+
+    memset(&draw->stats, 0, sizeof(draw->stats));
+    draw_prepare(draw->prog);
+    atlas_prepare(draw, fontset);
+    present_frame(draw, frame, fontset, (GfxSpan){ 0 });
+}
+
+// Draws newline-separated text over the top-right corner of the most recent frame, in
+// the frame's cell grid. Intended for diagnostics, so only single-cell characters and
+// the default colors (inverted) are supported
+static void
+draw_overlay(const char *text, FontSet *fontset)
+{
+    GfxDraw *const draw = get_draw();
+
+    if (!text || !fontset || !draw->grid.cols || !draw->grid.rows) {
+        return;
+    }
+
+    int width = 0;
+    for (const char *str = text; *str; ) {
+        const int len = strcspn(str, "\n");
+        width = MAX(width, len);
+        str += len + !!str[len];
+    }
+
+    const int left = MAX(0, draw->grid.cols - width);
+    int nrows = 0;
+
+    arr_clear(draw->overlay.quads);
+
+    // Backgrounds must be drawn before any glyphs
+    for (int pass = 0; pass < 2; pass++) {
+        const char *str = text;
+
+        for (int row = 0; *str && row < draw->grid.rows; row++) {
+            const int len = strcspn(str, "\n");
+
+            if (pass == 0) {
+                nrows++;
+                // A single run covering the whole box
+                const GfxQuad quad = {
+                    .cell  = { left, grid_slot(draw, row) },
+                    .glyph = { MIN(width, draw->grid.cols - left), 0 },
+                    .color = { COLOR_KEY|FOREGROUND, COLOR_KEY|BACKGROUND }
+                };
+                arr_push(draw->overlay.quads, quad);
             } else {
-                // Cursor cell is beyond the last glyph, gets appended
-                quad = &quads[idx++];
-                quad->dst = VEC4F(ox + ccol * dx, oy + crow * dy, dx, dy);
-                quad->src = VEC4F(0, 0, 0, 0);
-                quad->tex = 0;
+                for (int i = 0; i < len && left + i < draw->grid.cols; i++) {
+                    if (str[i] != ' ') {
+                        const Texture tex = fontset_get_glyph_texture(fontset, 0, (uchar)str[i]);
+                        const GfxQuad quad = {
+                            .cell  = { left + i, grid_slot(draw, row) },
+                            .glyph = { tex.tile, QUAD_GLYPH },
+                            .color = { COLOR_KEY|FOREGROUND, COLOR_KEY|BACKGROUND }
+                        };
+                        arr_push(draw->overlay.quads, quad);
+                    }
+                }
             }
 
-            // Always the same colors
-            quad->bg = unpack_argb(frame->palette->fg);
-            quad->fg = unpack_argb(frame->palette->bg);
+            str += len + !!str[len];
         }
     }
 
-    draw_quads(quads, idx);
+    const uint count = arr_count(draw->overlay.quads);
+
+    if (count) {
+        // The overlay is drawn straight to the target, over a back buffer of any age. It's
+        // erased by copying the rows under it from the canvas in the next frame
+        if (draw->present.pending) {
+            clear_target(draw);
+        }
+
+        const int top = MAX(0, draw->height - draw->grid.rows * draw->grid.cheight) / 2;
+        draw->present.overlay = (GfxSpan){ top, top + nrows * draw->grid.cheight };
+        draw->present.damage = span_union(draw->present.damage, draw->present.overlay);
+
+        draw_prepare(draw->prog);
+        glBindVertexArray(draw->overlay.vao);
+        glBindBuffer(GL_ARRAY_BUFFER, draw->overlay.vbo);
+        glBufferData(GL_ARRAY_BUFFER,
+                     count * sizeof(*draw->overlay.quads),
+                     draw->overlay.quads,
+                     GL_STREAM_DRAW);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+    }
+}
+
+// Without a compositor, exposed parts of the window hold garbage until the next swap.
+// Repainting makes the next frame damage (and present) everything
+static void
+expose(void)
+{
+    get_draw()->present.reset = true;
+}
+
+static void
+get_stats(GfxStats *stats)
+{
+    *stats = get_draw()->stats;
+}
+
+const GfxBackend gfx_backend_gl = {
+    .clear        = clear,
+    .draw_frame   = draw_frame,
+    .draw_cursor  = draw_cursor,
+    .draw_overlay = draw_overlay,
+    .expose       = expose,
+    .get_stats    = get_stats
+};
+
+static void
+create_instance_buffer(GLuint *r_vao, GLuint *r_vbo)
+{
+    glGenVertexArrays(1, r_vao);
+    glGenBuffers(1, r_vbo);
+    glBindVertexArray(*r_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, *r_vbo);
+
+    bind_instances(0);
 }
 
 bool
-gfx_renderer_init(void)
+gfx_renderer_init(Gfx *gfx)
 {
     GfxDraw *const draw = get_draw();
 
+    draw->gfx = gfx;
+
     GLuint shaders[2] = { 0 };
 
     if (!(shaders[0] = gl_compile_shader(shader_vert, GL_VERTEX_SHADER))) {
@@ -325,29 +1164,32 @@ gfx_renderer_init(void)
 
     glUseProgram(draw->prog);
 
-    glGenVertexArrays(1, &draw->vao);
-    glGenBuffers(1, &draw->vbo);
-    glBindVertexArray(draw->vao);
-    glBindBuffer(GL_ARRAY_BUFFER, draw->vbo);
-
-    for (uint i = 0; i < LEN(quad_attrs); i++) {
-        const GfxQuadAttr *qa = &quad_attrs[i];
-        gl_define_attr(i, qa->count, qa->type, qa->stride, qa->offset);
+    for (uint n = 0; n < NUM_BUFFERS * NUM_LAYERS; n++) {
+        GfxStream *const stream = &draw->buffers[n/NUM_LAYERS].streams[n%NUM_LAYERS];
+        create_instance_buffer(&stream->vao, &stream->vbo);
     }
+    create_instance_buffer(&draw->overlay.vao, &draw->overlay.vbo);
+    create_instance_buffer(&draw->cursor.vao, &draw->cursor.vbo);
 
-    glUniform1i(glGetUniformLocation(draw->prog, "samplers[0]"), 0);
-    glUniform1i(glGetUniformLocation(draw->prog, "samplers[1]"), 1);
-    glUniform1i(glGetUniformLocation(draw->prog, "samplers[2]"), 2);
-    glUniform1i(glGetUniformLocation(draw->prog, "samplers[3]"), 3);
+    glUniform1i(glGetUniformLocation(draw->prog, "u_atlas"), 0);
+    glUniform1i(glGetUniformLocation(draw->prog, "u_palette"), 1);
+    glUniform1i(glGetUniformLocation(draw->prog, "u_glyphs"), 2);
 
-    draw->uniforms.projection = glGetUniformLocation(draw->prog, "u_projection");
+    glGenTextures(1, &draw->palette.tex);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, draw->palette.tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, NUM_COLORS, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glActiveTexture(GL_TEXTURE0);
 
-    glBufferData(GL_ARRAY_BUFFER,
-                 MAX_QUADS * sizeof(*draw->quads),
-                 NULL,
-                 GL_DYNAMIC_DRAW);
-    ASSERT(!draw->quads);
-    draw->quads = xcalloc(MAX_QUADS, sizeof(*draw->quads));
+    draw->uniforms.projection  = glGetUniformLocation(draw->prog, "u_projection");
+    draw->uniforms.origin      = glGetUniformLocation(draw->prog, "u_origin");
+    draw->uniforms.cell        = glGetUniformLocation(draw->prog, "u_cell");
+    draw->uniforms.grid        = glGetUniformLocation(draw->prog, "u_grid");
+    draw->uniforms.atlas_size  = glGetUniformLocation(draw->prog, "u_atlas_size");
 
     return true;
 }
@@ -357,7 +1199,72 @@ gfx_renderer_fini(void)
 {
     GfxDraw *const draw = get_draw();
 
-    FREE(draw->quads);
+    for (uint i = 0; i < NUM_LAYERS; i++) {
+        GfxLayer *const layer = &draw->grid.layers[i];
+        FREE(layer->scratch);
+        FREE(layer->counts);
+        FREE(layer->offsets);
+        FREE(layer->packed);
+    }
+    FREE(draw->grid.dirty);
+    FREE(draw->grid.redraw);
+    FREE(draw->grid.stamps);
+    memset(&draw->grid, 0, sizeof(draw->grid));
+    draw->atlas = 0;
+
+    glDeleteTextures(1, &draw->palette.tex);
+    memset(&draw->palette, 0, sizeof(draw->palette));
+
+    for (uint n = 0; n < NUM_BUFFERS * NUM_LAYERS; n++) {
+        GfxStream *const stream = &draw->buffers[n/NUM_LAYERS].streams[n%NUM_LAYERS];
+        glDeleteBuffers(1, &stream->vbo);
+        glDeleteVertexArrays(1, &stream->vao);
+        FREE(stream->stamps);
+        FREE(stream->offsets);
+        memset(stream, 0, sizeof(*stream));
+    }
+
+    glDeleteBuffers(1, &draw->overlay.vbo);
+    glDeleteVertexArrays(1, &draw->overlay.vao);
+    arr_free(draw->overlay.quads);
+    memset(&draw->overlay, 0, sizeof(draw->overlay));
+
+    glDeleteBuffers(1, &draw->cursor.vbo);
+    glDeleteVertexArrays(1, &draw->cursor.vao);
+    memset(&draw->cursor, 0, sizeof(draw->cursor));
+
+    glDeleteFramebuffers(LEN(draw->canvas.fbo), draw->canvas.fbo);
+    glDeleteRenderbuffers(LEN(draw->canvas.rbo), draw->canvas.rbo);
+    memset(&draw->canvas, 0, sizeof(draw->canvas));
+}
+
+// (Re)allocates both canvases at the target's size. Their contents are undefined
+static bool
+canvas_resize(GfxDraw *draw, int width, int height)
+{
+    if (!draw->canvas.fbo[0]) {
+        glGenFramebuffers(LEN(draw->canvas.fbo), draw->canvas.fbo);
+        glGenRenderbuffers(LEN(draw->canvas.rbo), draw->canvas.rbo);
+    }
+
+    bool result = true;
+
+    for (uint i = 0; i < LEN(draw->canvas.fbo); i++) {
+        glBindRenderbuffer(GL_RENDERBUFFER, draw->canvas.rbo[i]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindFramebuffer(GL_FRAMEBUFFER, draw->canvas.fbo[i]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER,
+                                  GL_COLOR_ATTACHMENT0,
+                                  GL_RENDERBUFFER,
+                                  draw->canvas.rbo[i]);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            result = false;
+        }
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, draw->target);
+
+    return result;
 }
 
 void
@@ -380,6 +1287,55 @@ gfx_renderer_resize(int width, int height)
     draw->width  = width;
     draw->height = height;
 
+    // Called between frames, so whatever is bound now is what gets presented
+    GLint target = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target);
+    draw->target = target;
+
+    if (width > 0 && height > 0 && !canvas_resize(draw, width, height)) {
+        err_printf("Incomplete canvas framebuffer (%dx%d)\n", width, height);
+    }
+
+    // The old buffers' contents don't carry over
+    draw->present.count = 0;
+    draw->present.reset = true;
+
     glViewport(0, 0, width, height);
 }
 
+// Finishes the frame, and returns the rectangle that changed since the previous one
+// (x, y from the bottom, width, height). Returns false if nothing did
+bool
+gfx_renderer_end_frame(int rect[4])
+{
+    GfxDraw *const draw = get_draw();
+
+    // Nothing was drawn since the clear, so it hasn't happened yet
+    if (draw->present.pending) {
+        clear_target(draw);
+    }
+
+    const GfxSpan damage = {
+        MAX(draw->present.damage.top, 0),
+        MIN(draw->present.damage.bottom, draw->height)
+    };
+
+    if (span_empty(damage)) {
+        return false;
+    }
+
+    memmove(&draw->present.history[1],
+            &draw->present.history[0],
+            (MAX_BUFFER_AGE - 1) * sizeof(*draw->present.history));
+    draw->present.history[0] = damage;
+    draw->present.count = MIN(draw->present.count + 1, MAX_BUFFER_AGE);
+    draw->present.damage = (GfxSpan){ 0 };
+
+    rect[0] = 0;
+    rect[1] = draw->height - damage.bottom;
+    rect[2] = draw->width;
+    rect[3] = damage.bottom - damage.top;
+
+    return true;
+}
+
@@ -19,10 +19,26 @@
 #define GFX_RENDERER_H__
 
 #include "common.h"
+#include "gfx_draw.h"
+#include "gfx_context.h"
 
-bool gfx_renderer_init(void);
+// Entry points of a drawing backend, dispatched to by the functions in gfx_draw.h
+typedef struct {
+    void (*clear)(uint32 rgb);
+    void (*draw_frame)(const Frame *, FontSet *);
+    void (*draw_cursor)(const Frame *, FontSet *);
+    void (*draw_overlay)(const char *, FontSet *);
+    void (*expose)(void);
+    void (*get_stats)(GfxStats *);
+} GfxBackend;
+
+extern const GfxBackend gfx_backend_gl;
+extern const GfxBackend gfx_backend_software;
+
+bool gfx_renderer_init(Gfx *gfx);
 void gfx_renderer_fini(void);
 void gfx_renderer_resize(int width, int height);
+bool gfx_renderer_end_frame(int rect[4]);
 
 #endif
 
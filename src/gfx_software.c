@@ -0,0 +1,681 @@
+/*------------------------------------------------------------------------------*
+ * This file is part of temu
+ * Copyright (C) 2021-2022 Benjamin Harkins
+ *
+ * temu is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *------------------------------------------------------------------------------*/
+
+// CPU renderer for hosts without a usable GPU. Cells are rasterized straight into an image
+// owned by the window system layer (e.g. an XShm segment). The image keeps its contents
+// between frames, so only damaged rows are redrawn (scrolls move the existing pixels), and
+// only the rows that changed need to be presented (see gfx_software_get_damage)
+
+#include "utils.h"
+#include "gfx_renderer.h"
+#include "gfx_software.h"
+#include "perf.h"
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+static struct {
+    GfxImage image;
+    uint32 clear;               // Color of the area around the grid
+    bool cleared;               // Image was filled with the clear color since it was bound
+    bool full;                  // Every row must be redrawn
+    uint32 palette[NUM_COLORS]; // Palette the grid was drawn with
+    int cols;
+    int rows;
+    int cwidth;
+    int cheight;
+    int x, y;                   // Pixel offset of the grid
+    uint8 *dirty;               // Rows to redraw
+    int overlay;                // Rows covered by the last overlay
+    struct {
+        bool visible;
+        int col;
+        int row;
+        CursorStyle style;
+    } cursor;                   // Cursor as it was last drawn
+    struct {
+        int top;
+        int bottom;
+    } damage;                   // Pixel rows changed since the last present
+    GfxStats stats;
+} globals;
+
+static inline uint32
+resolve_color(const Palette *palette, Color color)
+{
+    return ((color.resolved) ? color.val : palette->table[color.key]) & 0xffffff;
+}
+
+static inline bool
+has_ink(const Cell *cell)
+{
+    switch (cell->ucs4) {
+    case 0:
+    case ' ':
+    case 0x00a0: // No-break space
+    case 0x3000: // Ideographic space
+        return false;
+    default:
+        return !(cell->attrs & ATTR_INVISIBLE);
+    }
+}
+
+static void
+add_damage(int y, int height)
+{
+    int top = MAX(y, 0);
+    int bottom = MIN(y + height, globals.image.height);
+
+    if (top >= bottom) {
+        return;
+    }
+    if (globals.damage.top < globals.damage.bottom) {
+        top = MIN(top, globals.damage.top);
+        bottom = MAX(bottom, globals.damage.bottom);
+    }
+
+    globals.damage.top = top;
+    globals.damage.bottom = bottom;
+}
+
+static inline void
+fill_span(uint32 *dst, int count, uint32 color)
+{
+    for (int i = 0; i < count; i++) {
+        dst[i] = color;
+    }
+}
+
+// Per-channel (bg * (255 - a) + fg * a) / 255, rounded. Every intermediate fits in 16 bits
+static inline uint32
+blend_pixel(uint32 bg, uint32 fg, uint a)
+{
+    uint32 result = 0;
+
+    for (uint shift = 0; shift < 24; shift += 8) {
+        const uint x = ((bg >> shift) & 0xff) * (255 - a) + ((fg >> shift) & 0xff) * a + 128;
+        result |= ((x + (x >> 8)) >> 8) << shift;
+    }
+
+    return result;
+}
+
+#if defined(__SSE2__)
+static inline __m128i
+blend_epi16(__m128i bg, __m128i fg, __m128i a)
+{
+    const __m128i x = _mm_add_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(bg, _mm_sub_epi16(_mm_set1_epi16(255), a)),
+                      _mm_mullo_epi16(fg, a)),
+        _mm_set1_epi16(128)
+    );
+
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+#endif
+
+// Writes a span of glyph coverage blended between two opaque colors. Both colors are
+// known up front, so the destination is never read back
+static void
+blend_span(uint32 *dst, const uchar *alpha, int count, uint32 bg, uint32 fg)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    // Four pixels at a time, one channel per 16-bit lane
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bg16 = _mm_unpacklo_epi8(_mm_set1_epi32(bg), zero);
+    const __m128i fg16 = _mm_unpacklo_epi8(_mm_set1_epi32(fg), zero);
+
+    for (; i + 4 <= count; i += 4) {
+        uint32 a4;
+        memcpy(&a4, alpha + i, sizeof(a4));
+
+        if (!a4) {
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_set1_epi32(bg));
+            continue;
+        }
+
+        // Broadcast each pixel's coverage to its four channels
+        __m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(a4), zero);
+        a = _mm_unpacklo_epi16(a, a);
+
+        const __m128i lo = blend_epi16(bg16, fg16, _mm_unpacklo_epi32(a, a));
+        const __m128i hi = blend_epi16(bg16, fg16, _mm_unpackhi_epi32(a, a));
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for (; i < count; i++) {
+        dst[i] = (alpha[i]) ? blend_pixel(bg, fg, alpha[i]) : bg;
+    }
+}
+
+// Returns the top-left pixel of a grid cell and its size after clipping to the image,
+// or NULL if nothing of it is visible
+static uint32 *
+get_cell(int col, int row, int *r_width, int *r_height)
+{
+    const int x = globals.x + col * globals.cwidth;
+    const int y = globals.y + row * globals.cheight;
+
+    *r_width = MIN(globals.cwidth, globals.image.width - x);
+    *r_height = MIN(globals.cheight, globals.image.height - y);
+
+    if (*r_width <= 0 || *r_height <= 0) {
+        return NULL;
+    }
+
+    return globals.image.pixels + y * globals.image.stride + x;
+}
+
+// Fills a cell with its background, blended with the part of the glyph's coverage that
+// falls inside it, if it has a glyph. The glyph is placed "shift" pixels to the left of
+// where it would go for this cell (i.e. the right half of a wide glyph)
+static void
+draw_cell(uint32 *dst,
+          int width,
+          int height,
+          uint32 bg,
+          uint32 fg,
+          const Texture *tex,
+          int shift,
+          const AtlasLayout *atlas)
+{
+    int x0 = 0, x1 = 0;
+    int y0 = 0, y1 = 0;
+    const uchar *alpha = NULL;
+
+    if (tex) {
+        x0 = CLAMP(tex->dx - shift, 0, width);
+        x1 = CLAMP(tex->dx - shift + tex->w, 0, width);
+        y0 = CLAMP(tex->dy, 0, height);
+        y1 = CLAMP(tex->dy + tex->h, 0, height);
+        alpha = atlas->layers[tex->layer] + (tex->y + y0 - tex->dy) * atlas->width +
+                                            (tex->x + x0 - tex->dx + shift);
+    }
+
+    for (int y = 0; y < height; y++, dst += globals.image.stride) {
+        if (x0 < x1 && y >= y0 && y < y1) {
+            fill_span(dst, x0, bg);
+            blend_span(dst + x0, alpha, x1 - x0, bg, fg);
+            fill_span(dst + x1, width - x1, bg);
+            alpha += atlas->width;
+        } else {
+            fill_span(dst, width, bg);
+        }
+    }
+}
+
+// Resolves the colors a cell is drawn with
+static inline void
+get_colors(const Palette *palette, const Cell *cell, uint32 *r_bg, uint32 *r_fg)
+{
+    uint32 bg = palette->bg & 0xffffff;
+    uint32 fg = palette->fg & 0xffffff;
+
+    if (cell->ucs4) {
+        bg = resolve_color(palette, cell->bg);
+        fg = resolve_color(palette, cell->fg);
+        if (cell->attrs & ATTR_INVERT) {
+            SWAP(uint32, bg, fg);
+        }
+    }
+
+    *r_bg = bg;
+    *r_fg = fg;
+}
+
+// Draws a cell of the frame, with the default colors swapped if it's under a block cursor.
+// Returns the number of pixel rows drawn, or 0 if the cell is outside the image. The cell
+// after a wide glyph shows the glyph's right half, like the GL renderer's two-cell quad
+static int
+draw_frame_cell(const Frame *frame,
+                FontSet *fontset,
+                const AtlasLayout *atlas,
+                int col,
+                int row,
+                bool cursor)
+{
+    const Cell *const cell = &frame->lines[row][col];
+    const Palette *const palette = frame->palette;
+    int width, height;
+    uint32 *const dst = get_cell(col, row, &width, &height);
+
+    if (!dst) {
+        return 0;
+    }
+
+    uint32 bg, fg;
+    const Cell *glyph = cell;
+    int shift = 0;
+
+    if (cell->type == CellTypeDummyWide && col > 0 && cell[-1].width == 2) {
+        glyph = &cell[-1];
+        shift = globals.cwidth;
+    }
+
+    if (cursor) {
+        // Always the same colors
+        bg = palette->fg & 0xffffff;
+        fg = palette->bg & 0xffffff;
+    } else {
+        uint32 unused;
+        get_colors(palette, cell, &bg, &fg);
+        get_colors(palette, glyph, &unused, &fg);
+    }
+
+    Texture tex;
+    const bool ink = has_ink(glyph);
+
+    if (ink) {
+        tex = fontset_get_glyph_texture(
+            fontset,
+            glyph->attrs & (ATTR_BOLD|ATTR_ITALIC),
+            glyph->ucs4
+        );
+        globals.stats.quads += (glyph == cell);
+    }
+
+    draw_cell(dst, width, height, bg, fg, (ink) ? &tex : NULL, shift, atlas);
+
+    return height;
+}
+
+static void
+draw_row(const Frame *frame, FontSet *fontset, const AtlasLayout *atlas, int row)
+{
+    int height = 0;
+
+    for (int col = 0; col < frame->cols; col++) {
+        const int n = draw_frame_cell(frame, fontset, atlas, col, row, false);
+        if (!n) {
+            break;
+        }
+        height = n;
+    }
+
+    add_damage(globals.y + row * globals.cheight, height);
+}
+
+static void
+draw_dirty_rows(const Frame *frame, FontSet *fontset, const AtlasLayout *atlas)
+{
+    const uint64 t = perf_now();
+    for (int row = 0; row < globals.rows; row++) {
+        if (globals.dirty[row]) {
+            draw_row(frame, fontset, atlas, row);
+            globals.stats.rows++;
+        }
+    }
+    perf_add(PERF_GLYPHS, t);
+}
+
+// Number of cells the cursor covers at the given cell: both cells of a wide glyph
+static inline int
+cursor_cells(const Frame *frame, int col, int row)
+{
+    return (frame->lines[row][col].width == 2 && col + 1 < frame->cols) ? 2 : 1;
+}
+
+// Fills the part of a rectangle that's inside a clipping size
+static void
+fill_rect(uint32 *dst, int clipw, int cliph, int x, int y, int width, int height, uint32 rgb)
+{
+    const int x1 = MIN(x + width, clipw);
+    const int y1 = MIN(y + height, cliph);
+
+    for (int i = y; x < x1 && i < y1; i++) {
+        fill_span(dst + i * globals.image.stride + x, x1 - x, rgb);
+    }
+}
+
+// Draws the cursor over its cell(s), like the GL renderer's cursor_draw(). Returns the
+// number of pixel rows drawn
+static int
+draw_frame_cursor(const Frame *frame, FontSet *fontset, const AtlasLayout *atlas)
+{
+    const CursorDesc *const cur = &frame->cursor;
+    const int ncells = cursor_cells(frame, cur->col, cur->row);
+    const bool block = (cur->style != CursorStyleUnderscore &&
+                        cur->style != CursorStyleBar &&
+                        cur->style != CursorStyleOutline);
+    int width = 0, height = 0;
+
+    for (int i = 0; i < ncells; i++) {
+        int w, h;
+        if (get_cell(cur->col + i, cur->row, &w, &h)) {
+            height = MAX(height, draw_frame_cell(frame, fontset, atlas, cur->col + i, cur->row, block));
+            width += w;
+        }
+    }
+
+    int unused;
+    uint32 *const dst = get_cell(cur->col, cur->row, &unused, &unused);
+
+    if (!dst || block) {
+        return height;
+    }
+
+    const int cwidth = globals.cwidth;
+    const int cheight = globals.cheight;
+    const int outer = ncells * cwidth;
+    const uint32 rgb = frame->palette->fg & 0xffffff;
+
+    switch (cur->style) {
+    case CursorStyleUnderscore: {
+        const int size = MAX(1, cheight / 8);
+        fill_rect(dst, width, height, 0, cheight - size, outer, size, rgb);
+        break;
+    }
+    case CursorStyleBar:
+        fill_rect(dst, width, height, 0, 0, MAX(1, cwidth / 8), cheight, rgb);
+        break;
+    case CursorStyleOutline:
+        fill_rect(dst, width, height, 0, 0, outer, 1, rgb);
+        fill_rect(dst, width, height, 0, cheight - 1, outer, 1, rgb);
+        fill_rect(dst, width, height, 0, 0, 1, cheight, rgb);
+        fill_rect(dst, width, height, outer - 1, 0, 1, cheight, rgb);
+        break;
+    default:
+        break;
+    }
+
+    return height;
+}
+
+// Erases the cursor where it was last drawn (moved along by a scroll), unless that row
+// was just redrawn, and draws it at its current cell
+static void
+update_cursor(const Frame *frame, FontSet *fontset, const AtlasLayout *atlas, int shift)
+{
+    const CursorDesc *const cur = &frame->cursor;
+    const bool visible = (cur->visible &&
+                          cur->col >= 0 && cur->col < globals.cols &&
+                          cur->row >= 0 && cur->row < globals.rows);
+    const bool moved = (shift ||
+                        visible != globals.cursor.visible ||
+                        cur->col != globals.cursor.col ||
+                        cur->row != globals.cursor.row ||
+                        cur->style != globals.cursor.style);
+    const int row = globals.cursor.row - shift;
+
+    if (moved && globals.cursor.visible && row >= 0 && row < globals.rows && !globals.dirty[row]) {
+        const int col = globals.cursor.col;
+        int n = 0;
+        for (int i = 0; i < cursor_cells(frame, col, row); i++) {
+            n = MAX(n, draw_frame_cell(frame, fontset, atlas, col + i, row, false));
+        }
+        add_damage(globals.y + row * globals.cheight, n);
+    }
+    if (visible && (moved || globals.dirty[cur->row])) {
+        const int n = draw_frame_cursor(frame, fontset, atlas);
+        add_damage(globals.y + cur->row * globals.cheight, n);
+    }
+
+    globals.cursor.visible = visible;
+    globals.cursor.col = cur->col;
+    globals.cursor.row = cur->row;
+    globals.cursor.style = cur->style;
+}
+
+static void
+clear(uint32 rgb)
+{
+    // The image keeps its contents, so this only needs to happen when they're undefined or
+    // the color changed
+    if (!globals.cleared || rgb != globals.clear) {
+        globals.clear = rgb;
+        globals.cleared = true;
+        globals.full = true;
+        for (int y = 0; y < globals.image.height; y++) {
+            fill_span(globals.image.pixels + y * globals.image.stride, globals.image.width, rgb);
+        }
+        add_damage(0, globals.image.height);
+    }
+}
+
+// Moves the grid's pixels by whole rows (up if shift > 0). Rows left behind are garbage
+static void
+scroll_rows(int shift)
+{
+    const int src = globals.y + MAX(shift, 0) * globals.cheight;
+    const int dst = globals.y + MAX(-shift, 0) * globals.cheight;
+    const int height = MIN((globals.rows - abs(shift)) * globals.cheight,
+                           globals.image.height - MAX(src, dst));
+
+    if (height > 0) {
+        memmove(globals.image.pixels + dst * globals.image.stride,
+                globals.image.pixels + src * globals.image.stride,
+                (size_t)height * globals.image.stride * sizeof(*globals.image.pixels));
+    }
+
+    add_damage(globals.y, globals.rows * globals.cheight);
+}
+
+static void
+draw_frame(const Frame *frame, FontSet *fontset)
+{
+    if (!frame || !fontset || frame->cols <= 0 || frame->rows <= 0 || !globals.image.pixels) {
+        return;
+    }
+
+    memset(&globals.stats, 0, sizeof(globals.stats));
+
+    const int cwidth = frame->width / frame->cols;
+    const int cheight = frame->height / frame->rows;
+    const int x = MAX(0, globals.image.width - frame->width) / 2;
+    const int y = MAX(0, globals.image.height - frame->height) / 2;
+
+    // The grid moved or changed size, so the border needs to be repainted as well
+    if (frame->cols != globals.cols ||
+        frame->rows != globals.rows ||
+        cwidth != globals.cwidth ||
+        cheight != globals.cheight ||
+        x != globals.x ||
+        y != globals.y)
+    {
+        globals.dirty = xrealloc(globals.dirty, frame->rows, sizeof(*globals.dirty));
+        globals.cols = frame->cols;
+        globals.rows = frame->rows;
+        globals.cwidth = cwidth;
+        globals.cheight = cheight;
+        globals.x = x;
+        globals.y = y;
+        globals.overlay = 0;
+        globals.cursor.visible = false;
+        globals.cleared = false;
+        clear(globals.clear);
+    }
+
+    if (memcmp(globals.palette, frame->palette->table, sizeof(globals.palette))) {
+        memcpy(globals.palette, frame->palette->table, sizeof(globals.palette));
+        globals.full = true;
+    }
+
+    if (abs(frame->scroll) >= globals.rows) {
+        globals.full = true;
+    }
+
+    const int shift = (globals.full) ? 0 : frame->scroll;
+    if (shift) {
+        scroll_rows(shift);
+    }
+
+    // Unlike the GL renderer, clean rows stay valid when glyphs are evicted from the
+    // atlas, since they were already rasterized
+    memset(globals.dirty, globals.full, globals.rows);
+    for (uint i = 0; !globals.full && i < arr_count(frame->damage); i++) {
+        const CellRect rect = frame->damage[i];
+        memset(&globals.dirty[rect.row], 1, rect.rows);
+    }
+
+    // Rows that scrolled in, or whose pixels came from under the last overlay or from
+    // outside the image, are redrawn as well
+    const int visible = MIN(globals.rows, (globals.image.height - globals.y) / globals.cheight);
+    for (int row = 0; row < globals.rows; row++) {
+        const int src = row + shift;
+        if (src < globals.overlay || src >= ((shift) ? visible : globals.rows)) {
+            globals.dirty[row] = 1;
+        }
+    }
+    globals.overlay = 0;
+    globals.full = false;
+
+    AtlasLayout atlas;
+    fontset_get_atlas_layout(fontset, &atlas);
+    ASSERT(atlas.layers);
+
+    draw_dirty_rows(frame, fontset, &atlas);
+    update_cursor(frame, fontset, &atlas, shift);
+}
+
+static void
+draw_cursor(const Frame *frame, FontSet *fontset)
+{
+    // The image must hold this frame already
+    if (!frame || !fontset || !globals.rows || !globals.image.pixels || globals.full) {
+        return;
+    }
+
+    memset(&globals.stats, 0, sizeof(globals.stats));
+
+    // Besides the cursor, only the rows under the last overlay need to be redrawn
+    memset(globals.dirty, 0, globals.rows);
+    memset(globals.dirty, 1, globals.overlay);
+    globals.overlay = 0;
+
+    AtlasLayout atlas;
+    fontset_get_atlas_layout(fontset, &atlas);
+
+    draw_dirty_rows(frame, fontset, &atlas);
+    update_cursor(frame, fontset, &atlas, 0);
+}
+
+// See the GL renderer's draw_overlay(). The rows it covers are redrawn by the next frame
+static void
+draw_overlay(const char *text, FontSet *fontset)
+{
+    if (!text || !fontset || !globals.cols || !globals.rows || !globals.image.pixels) {
+        return;
+    }
+
+    int width = 0;
+    for (const char *str = text; *str; ) {
+        const int len = strcspn(str, "\n");
+        width = MAX(width, len);
+        str += len + !!str[len];
+    }
+
+    const int left = MAX(0, globals.cols - width);
+    const uint32 bg = globals.palette[FOREGROUND] & 0xffffff;
+    const uint32 fg = globals.palette[BACKGROUND] & 0xffffff;
+
+    AtlasLayout atlas;
+    fontset_get_atlas_layout(fontset, &atlas);
+
+    int row = 0;
+
+    for (const char *str = text; *str && row < globals.rows; row++) {
+        const int len = strcspn(str, "\n");
+        int height = 0;
+
+        for (int col = left; col < globals.cols; col++) {
+            const int i = col - left;
+            int cwidth;
+            uint32 *const dst = get_cell(col, row, &cwidth, &height);
+
+            if (!dst) {
+                break;
+            }
+
+            Texture tex;
+            const bool ink = (i < len && str[i] != ' ');
+            if (ink) {
+                tex = fontset_get_glyph_texture(fontset, 0, (uchar)str[i]);
+            }
+
+            draw_cell(dst, cwidth, height, bg, fg, (ink) ? &tex : NULL, 0, &atlas);
+        }
+
+        add_damage(globals.y + row * globals.cheight, height);
+        str += len + !!str[len];
+    }
+
+    globals.overlay = row;
+}
+
+// The window presents exposed areas from the image again, so there's nothing to redraw
+static void
+expose(void)
+{
+}
+
+static void
+get_stats(GfxStats *stats)
+{
+    *stats = globals.stats;
+}
+
+const GfxBackend gfx_backend_software = {
+    .clear        = clear,
+    .draw_frame   = draw_frame,
+    .draw_cursor  = draw_cursor,
+    .draw_overlay = draw_overlay,
+    .expose       = expose,
+    .get_stats    = get_stats
+};
+
+// Sets the image to draw to, which is assumed to hold garbage. Passing NULL releases
+// the renderer's resources
+void
+gfx_software_bind(const GfxImage *image)
+{
+    if (!image) {
+        FREE(globals.dirty);
+        memset(&globals, 0, sizeof(globals));
+        return;
+    }
+
+    globals.image = *image;
+    globals.cleared = false;
+    globals.full = true;
+    globals.cols = 0;
+    globals.rows = 0;
+    globals.overlay = 0;
+    globals.cursor.visible = false;
+    globals.damage.top = 0;
+    globals.damage.bottom = 0;
+}
+
+// Returns the band of pixel rows that changed since the last call, if any
+bool
+gfx_software_get_damage(int *r_y, int *r_height)
+{
+    if (globals.damage.top >= globals.damage.bottom) {
+        return false;
+    }
+
+    SETPTR(r_y, globals.damage.top);
+    SETPTR(r_height, globals.damage.bottom - globals.damage.top);
+    globals.damage.top = 0;
+    globals.damage.bottom = 0;
+
+    return true;
+}
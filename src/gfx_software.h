@@ -0,0 +1,34 @@
+/*------------------------------------------------------------------------------*
+ * This file is part of temu
+ * Copyright (C) 2021-2022 Benjamin Harkins
+ *
+ * temu is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *------------------------------------------------------------------------------*/
+
+#ifndef GFX_SOFTWARE_H__
+#define GFX_SOFTWARE_H__
+
+#include "common.h"
+
+// Target of the software renderer: 32-bit pixels, 0x00RRGGBB in native byte order
+typedef struct {
+    uint32 *pixels;
+    int width;
+    int height;
+    int stride; // Pixels per row
+} GfxImage;
+
+void gfx_software_bind(const GfxImage *image);
+bool gfx_software_get_damage(int *r_y, int *r_height);
+
+#endif
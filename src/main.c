@@ -41,7 +41,7 @@ main(int argc, char **argv)
     Options opts = { 0 };
 
     // TODO(ben): Long options
-    for (int opt; (opt = getopt(argc, argv, "T:N:C:S:F:f:b:l:c:r:s:")) != -1; ) {
+    for (int opt; (opt = getopt(argc, argv, "T:N:C:S:F:f:b:l:c:r:s:R:VBXP:L")) != -1; ) {
         switch (opt) {
         case 'T': opts.wm_title  = get_str(optarg); break;
         case 'N': opts.wm_name   = get_str(optarg); break;
@@ -49,6 +49,12 @@ main(int argc, char **argv)
         case 'S': opts.shell     = get_str(optarg); break;
         case 'f': opts.font      = get_str(optarg); break;
         case 'F': opts.fontpath  = get_str(optarg); break;
+        case 'P': opts.perf_csv  = get_str(optarg); break;
+        case 'L': opts.latency   = true; break;
+        case 'V': opts.novsync   = true; break;
+        case 'B': opts.noblink   = true; break;
+        case 'X': opts.software  = true; break;
+        case 'R': opts.refresh   = get_uint(optarg, INT16_MAX); break;
         case 'b': opts.border    = get_uint(optarg, INT16_MAX); break;
         case 'l': opts.histlines = get_uint(optarg, INT16_MAX); break;
         case 'c': opts.cols      = get_uint(optarg, INT16_MAX); break;
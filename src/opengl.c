@@ -64,10 +64,18 @@ gl_link_shaders(GLuint *shaders, uint count)
     return program;
 }
 
+// Defines a per-instance vertex attribute. Integer types are passed to the shader as
+// integers, unless "normalized" is set - in which case they're converted to floats in
+// the [0,1] (or [-1,1]) range
 void
-gl_define_attr(GLuint idx, GLint count, GLenum type, GLsizei stride, uintptr_t offset)
+gl_define_attr(GLuint idx,
+               GLint count,
+               GLenum type,
+               bool normalized,
+               GLsizei stride,
+               uintptr_t offset)
 {
-    bool is_float = false;
+    bool is_float = normalized;
 
     switch (type) {
     case GL_BYTE:
@@ -89,7 +97,7 @@ gl_define_attr(GLuint idx, GLint count, GLenum type, GLsizei stride, uintptr_t o
     glVertexAttribDivisor(idx, 1);
 
     if (is_float) {
-        glVertexAttribPointer(idx, count, type, GL_FALSE, stride, (void *)offset);
+        glVertexAttribPointer(idx, count, type, normalized, stride, (void *)offset);
     } else {
         glVertexAttribIPointer(idx, count, type, stride, (void *)offset);
     }
@@ -41,7 +41,12 @@
 
 GLuint gl_compile_shader(const char *src, GLenum type);
 GLuint gl_link_shaders(GLuint *shaders, uint count);
-void gl_define_attr(GLuint idx, GLint count, GLenum type, GLsizei stride, uintptr_t offset);
+void gl_define_attr(GLuint idx,
+                    GLint count,
+                    GLenum type,
+                    bool normalized,
+                    GLsizei stride,
+                    uintptr_t offset);
 const char *gl_type_string(GLenum type);
 
 #if (BUILD_DEBUG)
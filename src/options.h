@@ -35,6 +35,12 @@ struct Options {
     int border;
     int tabcols;
     int histlines;
+    int refresh;
+    bool novsync;
+    bool noblink;
+    bool software;
+    char *perf_csv;
+    bool latency;
 };
 
 #endif
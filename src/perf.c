@@ -0,0 +1,418 @@
+/*------------------------------------------------------------------------------*
+ * This file is part of temu
+ * Copyright (C) 2021-2022 Benjamin Harkins
+ *
+ * temu is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *------------------------------------------------------------------------------*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "utils.h"
+#include "perf.h"
+
+// Number of frames kept (about a minute at 60 hz)
+#define PERF_RING_SIZE 4096
+
+static_assert(!(PERF_RING_SIZE & (PERF_RING_SIZE - 1)), "Ring size must be a power of 2");
+
+// Upper bound on retained latency samples
+#define PROBE_MAX_SAMPLES 65536
+
+// Latency probe stages, in the order they're reached
+#define X_PROBE_STAGES \
+    X_(KEY,   "key")   /* Key press handled            */ \
+    X_(WRITE, "write") /* Input written to the PTY     */ \
+    X_(ECHO,  "echo")  /* First byte read back         */ \
+    X_(DRAW,  "draw")  /* Frame containing it is drawn */ \
+    X_(SWAP,  "swap")  /* Frame is presented           */
+
+enum {
+#define X_(id,name) PROBE_##id,
+    X_PROBE_STAGES
+#undef X_
+    NUM_PROBE_STAGES
+};
+
+typedef struct {
+    uint64 times[NUM_PROBE_STAGES]; // Timestamp of each stage (ns)
+    uint32 delivery; // Server timestamp -> arrival (ms), UINT32_MAX if unknown
+} ProbeSample;
+
+static const char *const phase_names[NUM_PERF_PHASES] = {
+#define X_(id,name) [PERF_##id] = name,
+    X_PERF_PHASES
+#undef X_
+};
+
+static const char *const stage_names[NUM_PROBE_STAGES] = {
+#define X_(id,name) [PROBE_##id] = name,
+    X_PROBE_STAGES
+#undef X_
+};
+
+// The in-progress frame is accumulated atomically, so any thread can report into it.
+// Completed frames are published to the ring and read back on the main thread only.
+// The parser thread's work isn't aligned with frames, so what it reports is taken as
+// a whole when a frame ends
+static struct {
+    _Atomic uint64 times[NUM_PERF_PHASES];
+    _Atomic uint64 bytes;
+    uint64 start;
+    PerfRecord ring[PERF_RING_SIZE];
+    uint64 head; // Number of records ever published
+
+    // Scratch space for summaries, so the HUD doesn't allocate every frame (main thread)
+    PerfRecord records[PERF_RING_SIZE];
+    uint64 values[PERF_RING_SIZE];
+
+    // Latency probe (main thread only)
+    struct {
+        bool enabled;
+        int stage;            // Last stage reached by the current sample (-1 if idle)
+        ProbeSample current;
+        ProbeSample *samples; // arr_*
+        uint dropped;         // Samples superseded by a newer key press
+    } probe;
+} globals;
+
+// Phases the parser thread reports into. They overlap frames rather than belonging to
+// one, so they're only reset by taking them in perf_frame_end()
+static inline bool
+is_async(uint phase)
+{
+    return phase == PERF_PARSE;
+}
+
+void
+perf_frame_begin(void)
+{
+    for (uint i = 0; i < NUM_PERF_PHASES; i++) {
+        if (!is_async(i)) {
+            atomic_store_explicit(&globals.times[i], 0, memory_order_relaxed);
+        }
+    }
+    globals.start = perf_now();
+}
+
+// Publishes the current frame. Frames that are never ended (i.e. idle ones) are simply
+// overwritten by the next perf_frame_begin()
+void
+perf_frame_end(void)
+{
+    const uint64 head = globals.head;
+    PerfRecord *const rec = &globals.ring[head & (PERF_RING_SIZE - 1)];
+
+    rec->frame = head;
+    rec->start = globals.start;
+    rec->bytes = atomic_exchange_explicit(&globals.bytes, 0, memory_order_relaxed);
+    for (uint i = 0; i < NUM_PERF_PHASES; i++) {
+        rec->times[i] = atomic_exchange_explicit(&globals.times[i], 0, memory_order_relaxed);
+    }
+
+    globals.head = head + 1;
+}
+
+void
+perf_add(PerfPhase phase, uint64 start)
+{
+    ASSERT(phase < NUM_PERF_PHASES);
+    atomic_fetch_add_explicit(&globals.times[phase], perf_now() - start, memory_order_relaxed);
+}
+
+void
+perf_add_bytes(size_t count)
+{
+    atomic_fetch_add_explicit(&globals.bytes, count, memory_order_relaxed);
+}
+
+// Copies up to "max" of the most recent records, oldest first. Frames are only ended on
+// this (the main) thread, so nothing can be overwritten while we're copying
+uint
+perf_get_records(PerfRecord *records, uint max)
+{
+    const uint64 head = globals.head;
+    const uint64 count = MIN(MIN(head, max), PERF_RING_SIZE);
+    const uint64 first = head - count;
+
+    for (uint64 i = first; i < head; i++) {
+        records[i-first] = globals.ring[i & (PERF_RING_SIZE - 1)];
+    }
+
+    return count;
+}
+
+static int
+cmp_uint64(const void *a, const void *b)
+{
+    const uint64 x = *(const uint64 *)a;
+    const uint64 y = *(const uint64 *)b;
+
+    return (x > y) - (x < y);
+}
+
+static inline void
+sort_values(uint64 *values, uint count)
+{
+    qsort(values, count, sizeof(*values), cmp_uint64);
+}
+
+// Nearest-rank percentile of sorted values
+static inline uint64
+get_percentile(const uint64 *values, uint count, uint pct)
+{
+    return values[MIN(count * pct / 100, count - 1)];
+}
+
+// Formats rolling p50/p99 times over the last "window" frames as newline-separated text
+size_t
+perf_format_summary(char *buf, size_t size, uint window)
+{
+    PerfRecord *const records = globals.records;
+    uint64 *const values = globals.values;
+    const uint count = perf_get_records(records, MIN(window, PERF_RING_SIZE));
+    size_t len = 0;
+    char label[16];
+
+#define PRINT(...) (len += snprintf(buf + len, (len < size) ? size - len : 0, __VA_ARGS__))
+    PRINT("%-7s %8s %8s\n", "ms", "p50", "p99");
+
+    // Rows marked with an asterisk are the parser thread's, since the previous frame
+    for (uint phase = 0; count && phase < NUM_PERF_PHASES; phase++) {
+        for (uint i = 0; i < count; i++) {
+            values[i] = records[i].times[phase];
+        }
+        sort_values(values, count);
+        snprintf(label, sizeof(label), "%s%s", phase_names[phase], (is_async(phase)) ? "*" : "");
+        PRINT("%-7s %8.3f %8.3f\n",
+              label,
+              get_percentile(values, count, 50) / 1e6,
+              get_percentile(values, count, 99) / 1e6);
+    }
+
+    if (count) {
+        for (uint i = 0; i < count; i++) {
+            values[i] = records[i].bytes;
+        }
+        sort_values(values, count);
+        PRINT("%-7s %8"PRIu64" %8"PRIu64"\n",
+              "bytes*",
+              get_percentile(values, count, 50),
+              get_percentile(values, count, 99));
+        PRINT("* parser, since last frame\n");
+    }
+#undef PRINT
+
+    return MIN(len, size ? size - 1 : 0);
+}
+
+bool
+perf_write_csv(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (!fp) {
+        err_printf("Failed to open \"%s\": %s\n", path, strerror(errno));
+        return false;
+    }
+
+    const PerfRecord *const records = globals.records;
+    const uint count = perf_get_records(globals.records, PERF_RING_SIZE);
+
+    // Parser thread columns cover everything it did since the previous frame
+    fprintf(fp, "frame,start_ns");
+    for (uint i = 0; i < NUM_PERF_PHASES; i++) {
+        fprintf(fp, ",%s%s_ns", phase_names[i], (is_async(i)) ? "_since_last_frame" : "");
+    }
+    fprintf(fp, ",bytes_since_last_frame\n");
+
+    for (uint n = 0; n < count; n++) {
+        const PerfRecord *rec = &records[n];
+        fprintf(fp, "%"PRIu64",%"PRIu64, rec->frame, rec->start);
+        for (uint i = 0; i < NUM_PERF_PHASES; i++) {
+            fprintf(fp, ",%"PRIu64, rec->times[i]);
+        }
+        fprintf(fp, ",%"PRIu64"\n", rec->bytes);
+    }
+
+    fclose(fp);
+
+    return true;
+}
+
+void
+perf_probe_enable(bool enable)
+{
+    globals.probe.enabled = enable;
+    globals.probe.stage = -1;
+}
+
+// Starts a new sample. Any sample still in flight is superseded, since the child's
+// output can no longer be attributed to it
+void
+perf_probe_key(uint32 srvtime)
+{
+    if (!globals.probe.enabled) {
+        return;
+    }
+
+    if (globals.probe.stage >= 0) {
+        globals.probe.dropped++;
+    }
+
+    ProbeSample *const sample = &globals.probe.current;
+
+    memset(sample, 0, sizeof(*sample));
+    sample->times[PROBE_KEY] = perf_now();
+
+    // X servers typically stamp events with CLOCK_MONOTONIC milliseconds. Anything
+    // implausible means it's a different clock, which can't be compared against ours
+    const uint32 delivery = timer_msec(NULL) - srvtime;
+    sample->delivery = (srvtime && delivery < 10000) ? delivery : UINT32_MAX;
+
+    globals.probe.stage = PROBE_KEY;
+}
+
+static void
+probe_advance(int stage)
+{
+    if (globals.probe.enabled && globals.probe.stage == stage - 1) {
+        globals.probe.current.times[stage] = perf_now();
+        globals.probe.stage = stage;
+    }
+}
+
+void
+perf_probe_input(size_t count)
+{
+    if (!count && globals.probe.stage == PROBE_KEY) {
+        // Key didn't produce any input
+        globals.probe.stage = -1;
+    }
+}
+
+// The key's input is queued behind anything that wasn't written yet, so it has reached
+// the PTY once nothing is left in the queue
+void
+perf_probe_write(size_t queued)
+{
+    if (!queued) {
+        probe_advance(PROBE_WRITE);
+    }
+}
+
+void
+perf_probe_read(size_t count)
+{
+    if (count) {
+        probe_advance(PROBE_ECHO);
+    }
+}
+
+void
+perf_probe_draw(void)
+{
+    probe_advance(PROBE_DRAW);
+}
+
+void
+perf_probe_swap(void)
+{
+    probe_advance(PROBE_SWAP);
+
+    if (globals.probe.stage == PROBE_SWAP) {
+        if (arr_count(globals.probe.samples) < PROBE_MAX_SAMPLES) {
+            arr_push(globals.probe.samples, globals.probe.current);
+        }
+        globals.probe.stage = -1;
+    }
+}
+
+static void
+print_latency(FILE *fp, const char *label, uint64 *values, uint count)
+{
+    if (!count) {
+        return;
+    }
+
+    sort_values(values, count);
+    fprintf(fp, "%-12s %9.3f %9.3f %9.3f %9.3f\n",
+            label,
+            get_percentile(values, count, 50) / 1e6,
+            get_percentile(values, count, 95) / 1e6,
+            get_percentile(values, count, 99) / 1e6,
+            values[count-1] / 1e6);
+}
+
+void
+perf_probe_report(FILE *fp)
+{
+    const ProbeSample *const samples = globals.probe.samples;
+    const uint count = arr_count(samples);
+
+    if (!globals.probe.enabled) {
+        return;
+    }
+
+    fprintf(fp, "\nInput latency: %u samples, %u superseded\n", count, globals.probe.dropped);
+    if (!count) {
+        return;
+    }
+
+    uint64 *values = xcalloc(count, sizeof(*values));
+    char label[32];
+
+    fprintf(fp, "%-12s %9s %9s %9s %9s\n", "ms", "p50", "p95", "p99", "max");
+
+    // Each stage relative to the previous one, then end-to-end
+    for (uint stage = 1; stage < NUM_PROBE_STAGES; stage++) {
+        for (uint i = 0; i < count; i++) {
+            values[i] = samples[i].times[stage] - samples[i].times[stage-1];
+        }
+        snprintf(label, sizeof(label), "%s-%s", stage_names[stage-1], stage_names[stage]);
+        print_latency(fp, label, values, count);
+    }
+
+    for (uint i = 0; i < count; i++) {
+        values[i] = samples[i].times[PROBE_SWAP] - samples[i].times[PROBE_KEY];
+    }
+    print_latency(fp, "total", values, count);
+
+    // Values are sorted now, so the histogram buckets can be counted in a single sweep
+    fprintf(fp, "\nKey press to swap:\n");
+    for (uint i = 0, limit = 1; i < count; limit *= 2) {
+        uint n = 0;
+        for (; i < count && (limit > 64 || values[i] < limit * UINT64_C(1000000)); i++) {
+            n++;
+        }
+        if (limit > 64) {
+            fprintf(fp, "  >= %3u ms %8u\n", limit / 2, n);
+        } else {
+            fprintf(fp, "  <  %3u ms %8u\n", limit, n);
+        }
+    }
+
+    uint nvalid = 0;
+    for (uint i = 0; i < count; i++) {
+        if (samples[i].delivery != UINT32_MAX) {
+            values[nvalid++] = samples[i].delivery * UINT64_C(1000000);
+        }
+    }
+    if (nvalid) {
+        fprintf(fp, "\n");
+        print_latency(fp, "server-key", values, nvalid);
+    }
+
+    FREE(values);
+}
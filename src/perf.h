@@ -0,0 +1,70 @@
+/*------------------------------------------------------------------------------*
+ * This file is part of temu
+ * Copyright (C) 2021-2022 Benjamin Harkins
+ *
+ * temu is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *------------------------------------------------------------------------------*/
+
+#ifndef PERF_H__
+#define PERF_H__
+
+#include "common.h"
+#include "utils.h"
+
+// Timed phases of a frame. "glyphs" and "upload" are part of "draw"
+#define X_PERF_PHASES \
+    X_(POLL,   "poll")   /* Blocked waiting for input or a deadline */ \
+    X_(EVENTS, "events") /* Window event processing                 */ \
+    X_(PARSE,  "parse")  /* Parser thread time since the last frame */ \
+    X_(FRAME,  "frame")  /* Building the terminal -> renderer frame */ \
+    X_(GLYPHS, "glyphs") /* Rebuilding rows, including glyph lookup */ \
+    X_(UPLOAD, "upload") /* Instance buffer uploads                 */ \
+    X_(DRAW,   "draw")   /* Total time spent in the renderer        */ \
+    X_(SWAP,   "swap")   /* Presenting the frame                    */
+
+typedef enum {
+#define X_(id,name) PERF_##id,
+    X_PERF_PHASES
+#undef X_
+    NUM_PERF_PHASES
+} PerfPhase;
+
+typedef struct {
+    uint64 frame;                  // Sequence number
+    uint64 start;                  // Frame start (ns, monotonic)
+    uint64 times[NUM_PERF_PHASES]; // Time spent in each phase (ns)
+    uint64 bytes;                  // PTY bytes parsed since the last frame
+} PerfRecord;
+
+static inline uint64 perf_now(void) { return timer_nsec(NULL); }
+
+void perf_frame_begin(void);
+void perf_frame_end(void);
+void perf_add(PerfPhase phase, uint64 start);
+void perf_add_bytes(size_t count);
+uint perf_get_records(PerfRecord *records, uint max);
+size_t perf_format_summary(char *buf, size_t size, uint window);
+bool perf_write_csv(const char *path);
+
+// Input latency probe. Follows one key press at a time from its arrival to the swap of
+// the first frame that includes the child's response
+void perf_probe_enable(bool enable);
+void perf_probe_key(uint32 srvtime);
+void perf_probe_input(size_t count);
+void perf_probe_write(size_t queued);
+void perf_probe_read(size_t count);
+void perf_probe_draw(void);
+void perf_probe_swap(void);
+void perf_probe_report(FILE *fp);
+
+#endif
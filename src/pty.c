@@ -24,7 +24,6 @@
 #include <unistd.h>
 #include <signal.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -109,6 +108,10 @@ pty_init(const char *shell, int *mfd_, int *sfd_)
     }
     default: // parent process
         close(sfd);
+        // Reads are done by the PTY reader thread, writes are queued by the terminal
+        if (fcntl(mfd, F_SETFL, fcntl(mfd, F_GETFL) | O_NONBLOCK) < 0) {
+            FATAL("fcntl O_NONBLOCK");
+        }
         break;
     }
 
@@ -126,64 +129,21 @@ pty_hangup(int cpid)
     }
 }
 
-size_t
-pty_read(int mfd, uchar *buf, size_t len)
-{
-    ASSERT(mfd > 0);
-
-    errno = 0;
-
-    fd_set rset;
-    FD_ZERO(&rset);
-    FD_SET(mfd, &rset);
-
-    const int res = pselect(mfd + 1, &rset, NULL, NULL, NULL, NULL);
-    if (res < 0 && errno != EINTR) {
-        FATAL("pselect");
-    } else if (res <= 0) {
-        return 0;
-    }
-
-    const ssize_t nread = read(mfd, buf, len);
-    if (nread < 0 && errno != EINTR) {
-        FATAL("read");
-    }
-
-    return MAX(0, nread);
-}
-
+// Non-blocking. Returns the number of bytes the PTY accepted, which is 0 if its buffer
+// is full or the child hung up
 size_t
 pty_write(int mfd, const uchar *buf, size_t len)
 {
     ASSERT(mfd > 0);
 
-    size_t idx = 0;
-    fd_set wset;
-
     errno = 0;
 
-    while (idx < len) {
-        FD_ZERO(&wset);
-        FD_SET(mfd, &wset);
-
-        if (pselect(mfd + 1, NULL, &wset, NULL, NULL, NULL) < 0) {
-            if (errno != EINTR) {
-                FATAL("pselect");
-            }
-            continue;
-        }
-
-        if (FD_ISSET(mfd, &wset)) {
-            const ssize_t nwrite = write(mfd, buf + idx, len - idx);
-            if (nwrite >= 0) {
-                idx += nwrite;
-            } else if (errno != EINTR) {
-                FATAL("write");
-            }
-        }
+    const ssize_t nwrite = write(mfd, buf, len);
+    if (nwrite < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && errno != EIO) {
+        FATAL("write");
     }
 
-    return idx;
+    return MAX(0, nwrite);
 }
 
 void
@@ -22,7 +22,6 @@
 
 int pty_init(const char *, int *, int *);
 void pty_hangup(int pid);
-size_t pty_read(int, uchar *, size_t);
 size_t pty_write(int, const uchar *, size_t);
 void pty_resize(int, int, int, int, int);
 
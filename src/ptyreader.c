@@ -0,0 +1,267 @@
+/*------------------------------------------------------------------------------*
+ * This file is part of temu
+ * Copyright (C) 2021-2022 Benjamin Harkins
+ *
+ * temu is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *------------------------------------------------------------------------------*/
+
+// Drains the PTY on a dedicated thread into a single-producer/single-consumer byte ring,
+// so the child never blocks on a full PTY buffer while the consumer (the parser) is busy.
+//
+// Either side only sleeps after announcing it through a flag, then re-checking the ring.
+// The other side clears the flag and writes a byte to the sleeper's pipe:
+//   - The reader wakes the consumer through "notify". The consumer polls it, and sees a
+//     hangup once the reader closes its end on EOF.
+//   - The consumer wakes the reader through "control" when it frees space, or to stop.
+//
+// The reader drains the PTY until it would block, with each read filling as much of the
+// ring as is contiguous. Pages of the ring are only committed as they're written, and
+// given back once a burst is over and the ring has stayed empty for a while
+
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS, madvise()
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "ptyreader.h"
+
+#define TRIM_BYTES   (1 << 18) // Bytes written since the last trim that make one worthwhile
+#define TRIM_TIMEOUT 1000      // Milliseconds the ring must stay empty before trimming
+
+struct PtyReader {
+    int mfd;
+    uchar *data;
+    size_t mask;          // Ring capacity - 1 (power of two)
+    size_t written;       // Bytes written since the ring was last trimmed (reader)
+    int notify[2];        // Reader -> consumer
+    int control[2];       // Consumer -> reader
+    pthread_t thread;
+    bool started;
+    _Atomic(size_t) head; // Total bytes written (reader)
+    _Atomic(size_t) tail; // Total bytes consumed (consumer)
+    atomic_bool full;     // Reader is waiting for space
+    atomic_bool empty;    // Consumer is waiting for data
+    atomic_bool stop;
+};
+
+static void *reader_main(void *arg);
+
+static void
+close_fd(int *fd)
+{
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+PtyReader *
+ptyreader_create(int mfd, size_t size)
+{
+    ASSERT(mfd > 0);
+    ASSERT(size && !(size & (size - 1)));
+
+    PtyReader *reader = xcalloc(1, sizeof(*reader));
+
+    reader->mfd = mfd;
+    reader->mask = size - 1;
+    reader->notify[0] = reader->notify[1] = -1;
+    reader->control[0] = reader->control[1] = -1;
+
+    if (!wakepipe_open(reader->notify) || !wakepipe_open(reader->control)) {
+        err_printf("pipe: %s\n", strerror(errno));
+        goto error;
+    }
+
+    // Page-aligned, so we can release it in whole
+    reader->data = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (reader->data == MAP_FAILED) {
+        reader->data = NULL;
+        err_printf("mmap: %s\n", strerror(errno));
+        goto error;
+    }
+
+    const int err = pthread_create(&reader->thread, NULL, reader_main, reader);
+    if (err) {
+        err_printf("pthread_create: %s\n", strerror(err));
+        goto error;
+    }
+
+    reader->started = true;
+
+    return reader;
+error:
+    ptyreader_destroy(reader);
+    return NULL;
+}
+
+void
+ptyreader_destroy(PtyReader *reader)
+{
+    if (!reader) return;
+
+    if (reader->started) {
+        atomic_store(&reader->stop, true);
+        wakepipe_signal(reader->control[1]);
+        pthread_join(reader->thread, NULL);
+    }
+
+    wakepipe_close(reader->notify);
+    wakepipe_close(reader->control);
+    if (reader->data) {
+        munmap(reader->data, reader->mask + 1);
+    }
+    FREE(reader);
+}
+
+int
+ptyreader_fileno(const PtyReader *reader)
+{
+    return reader->notify[0];
+}
+
+// Returns the number of unconsumed bytes. If there are none, the reader's next write
+// wakes the notification descriptor
+size_t
+ptyreader_poll(PtyReader *reader)
+{
+    wakepipe_clear(reader->notify[0]);
+
+    const size_t tail = atomic_load_explicit(&reader->tail, memory_order_relaxed);
+    size_t count = atomic_load_explicit(&reader->head, memory_order_acquire) - tail;
+
+    if (!count) {
+        atomic_store(&reader->empty, true);
+        // Re-check, in case the reader wrote after our first check but before it could
+        // see the flag. If it didn't, it's guaranteed to see the flag on its next write
+        if ((count = atomic_load(&reader->head) - tail)) {
+            atomic_store(&reader->empty, false);
+        }
+    }
+
+    return count;
+}
+
+// Returns the contiguous run of unconsumed bytes, which may be less than all of them if
+// the ring wraps
+size_t
+ptyreader_peek(PtyReader *reader, const uchar **r_data)
+{
+    const size_t tail = atomic_load_explicit(&reader->tail, memory_order_relaxed);
+    const size_t head = atomic_load_explicit(&reader->head, memory_order_acquire);
+    const size_t offset = tail & reader->mask;
+
+    *r_data = reader->data + offset;
+
+    return MIN(head - tail, reader->mask + 1 - offset);
+}
+
+void
+ptyreader_consume(PtyReader *reader, size_t count)
+{
+    const size_t tail = atomic_load_explicit(&reader->tail, memory_order_relaxed);
+
+    ASSERT(count <= atomic_load(&reader->head) - tail);
+
+    atomic_store(&reader->tail, tail + count);
+
+    if (atomic_load(&reader->full) && atomic_exchange(&reader->full, false)) {
+        wakepipe_signal(reader->control[1]);
+    }
+}
+
+// Blocks on the given descriptors. Returns false if we were told to stop
+static bool
+reader_wait(PtyReader *reader, bool input)
+{
+    struct pollfd pollset[2] = {
+        { .fd = reader->control[0], .events = POLLIN },
+        { .fd = reader->mfd,        .events = POLLIN },
+    };
+
+    // After a burst, wait for input with a timeout. If none arrives and the consumer
+    // caught up, the pages it touched are released
+    const bool trim = (input && reader->written >= TRIM_BYTES);
+    int res;
+
+    while ((res = poll(pollset, (input) ? 2 : 1, (trim) ? TRIM_TIMEOUT : -1)) < 0) {
+        if (errno != EINTR) {
+            err_printf("poll: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    if (pollset[0].revents) {
+        wakepipe_clear(reader->control[0]);
+    }
+
+    if (!res && atomic_load(&reader->tail) == atomic_load(&reader->head)) {
+        // An empty ring is never read, so the pages can be zero-filled on the next write
+        madvise(reader->data, reader->mask + 1, MADV_DONTNEED);
+        reader->written = 0;
+    }
+
+    return !atomic_load(&reader->stop);
+}
+
+void *
+reader_main(void *arg)
+{
+    PtyReader *const reader = arg;
+    const size_t size = reader->mask + 1;
+
+    while (!atomic_load(&reader->stop)) {
+        const size_t head = atomic_load_explicit(&reader->head, memory_order_relaxed);
+        const size_t tail = atomic_load_explicit(&reader->tail, memory_order_acquire);
+
+        if (head - tail == size) {
+            // Same handshake as ptyreader_poll(), with the roles reversed
+            atomic_store(&reader->full, true);
+            if (atomic_load(&reader->tail) == tail) {
+                if (!reader_wait(reader, false)) break;
+            } else {
+                atomic_store(&reader->full, false);
+            }
+            continue;
+        }
+
+        const size_t offset = head & reader->mask;
+        const size_t len = MIN(size - (head - tail), size - offset);
+
+        errno = 0;
+        const ssize_t nread = read(reader->mfd, reader->data + offset, len);
+
+        if (nread > 0) {
+            reader->written += nread;
+            atomic_store(&reader->head, head + nread);
+            if (atomic_load(&reader->empty) && atomic_exchange(&reader->empty, false)) {
+                wakepipe_signal(reader->notify[1]);
+            }
+        } else if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if (!reader_wait(reader, true)) break;
+        } else {
+            // EOF or EIO, i.e. the child hung up
+            break;
+        }
+    }
+
+    // Closing our end makes the consumer see a hangup
+    close_fd(&reader->notify[1]);
+
+    return NULL;
+}
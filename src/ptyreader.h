@@ -0,0 +1,32 @@
+/*------------------------------------------------------------------------------*
+ * This file is part of temu
+ * Copyright (C) 2021-2022 Benjamin Harkins
+ *
+ * temu is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *------------------------------------------------------------------------------*/
+
+#ifndef PTYREADER_H__
+#define PTYREADER_H__
+
+#include "common.h"
+
+typedef struct PtyReader PtyReader;
+
+PtyReader *ptyreader_create(int mfd, size_t size);
+void ptyreader_destroy(PtyReader *reader);
+int ptyreader_fileno(const PtyReader *reader);
+size_t ptyreader_poll(PtyReader *reader);
+size_t ptyreader_peek(PtyReader *reader, const uchar **r_data);
+void ptyreader_consume(PtyReader *reader, size_t count);
+
+#endif
@@ -23,7 +23,11 @@
 #include "term_parser.h"
 #include "term_ring.h"
 #include "gfx_draw.h"
+#include "perf.h"
 
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
 #include <unistd.h> // for isatty()
 
 static void cursor_init(Cursor *cur);
@@ -33,6 +37,7 @@ static int cursor_set_x_rel(Cursor *cur, int x, int max);
 static int cursor_set_y_rel(Cursor *cur, int y, int max);
 
 static size_t term_consume(Term *term, const uchar *data, size_t len);
+static void *parser_main(void *arg);
 static void term_write_printable(Term *term, uint32 ucs4, CellType type);
 static void term_write_tab(Term *term);
 static void term_write_newline(Term *term);
@@ -53,7 +58,7 @@ static void term_reset_cell_attrs(Term *term);
 static void term_reset_cell(Term *term);
 static void term_set_screen(Term *term, bool alt);
 
-static void alloc_frame(Frame *, uint16, uint16);
+static void alloc_frame(Frame *, uint8 **, uint16);
 static void alloc_tabstops(uint8 **, uint16, uint16, uint16);
 static void update_dimensions(Term *, uint16, uint16);
 
@@ -149,10 +154,15 @@ term_create(App *app)
     term->rings[1] = ring_create(term->rows, term->cols, term->rows);
     term->ring = term->rings[0];
 
-    alloc_frame(&term->frame, term->cols, term->rows);
+    alloc_frame(&term->frame, &term->dirty, term->rows);
     alloc_tabstops(&term->tabstops, 0, term->cols, term->tabcols);
     update_dimensions(term, term->cols, term->rows);
 
+    pthread_mutex_init(&term->lock, NULL);
+    pthread_mutex_init(&term->outlock, NULL);
+    term->control[0] = term->control[1] = -1;
+    term->notify[0] = term->notify[1] = -1;
+
     // Done
     term->app = app;
 
@@ -175,10 +185,26 @@ void
 term_destroy(Term *term)
 {
     ASSERT(term);
-    parser_fini(&term->parser);
-    if (term->frame.cells) {
-        free(term->frame.cells);
+
+    if (term->started) {
+        atomic_store(&term->stop, true);
+        wakepipe_signal(term->control[1]);
+        pthread_join(term->worker, NULL);
     }
+    ptyreader_destroy(term->reader);
+    wakepipe_close(term->control);
+    wakepipe_close(term->notify);
+    pthread_mutex_destroy(&term->lock);
+    pthread_mutex_destroy(&term->outlock);
+    FREE(term->output);
+
+    parser_fini(&term->parser);
+    FREE(term->snapshot);
+    arr_free(term->title);
+    arr_free(term->icon);
+    FREE(term->frame.lines);
+    arr_free(term->frame.damage);
+    FREE(term->dirty);
     if (term->tabstops) {
         free(term->tabstops);
     }
@@ -190,7 +216,9 @@ term_destroy(Term *term)
 }
 
 // Start terminal child process using the specified shell and command-line.
-// Initialize the escape sequence parser
+// Initialize the escape sequence parser and start the threads that read and parse the
+// child's output. Returns a descriptor that becomes readable when new input was parsed,
+// and hangs up once the child exited and its last output was parsed
 int
 term_exec(Term *term, const char *shell, int argc, const char *const *argv)
 {
@@ -202,43 +230,166 @@ term_exec(Term *term, const char *shell, int argc, const char *const *argv)
     if (!term->pid) {
         parser_init(&term->parser);
         term->pid = pty_init(shell, &term->mfd, &term->sfd);
-        pty_resize(term->mfd, term->cols, term->rows, term->cwidth, term->cheight);
+        term_sync_winsize(term);
+        if (!(term->reader = ptyreader_create(term->mfd, INPUT_RING_SIZE))) {
+            return 0;
+        }
+        if (!wakepipe_open(term->control) || !wakepipe_open(term->notify)) {
+            err_printf("pipe: %s\n", strerror(errno));
+            return 0;
+        }
+        const int err = pthread_create(&term->worker, NULL, parser_main, term);
+        if (err) {
+            err_printf("pthread_create: %s\n", strerror(err));
+            return 0;
+        }
+        term->started = true;
     }
 
-    return term->mfd;
+    return term->notify[0];
 }
 
 int term_cols(const Term *term) { return term->cols; }
 int term_rows(const Term *term) { return term->rows; }
 
+// The parser yields between chunks while the main thread is waiting, so locking doesn't
+// stall behind a flood of input
+static void
+term_lock(Term *term)
+{
+    atomic_fetch_add(&term->waiting, 1);
+    pthread_mutex_lock(&term->lock);
+    atomic_fetch_sub(&term->waiting, 1);
+}
+
+static void
+term_unlock(Term *term)
+{
+    pthread_mutex_unlock(&term->lock);
+}
+
+// Rebuilds the frame's damage list from the ring's per-row damage. Rows that only moved
+// with a scroll aren't damaged
+static void
+update_damage(Term *term)
+{
+    Frame *frame = &term->frame;
+    uint8 *const dirty = term->dirty;
+
+    arr_clear(frame->damage);
+    ring_commit(term->ring, dirty, &frame->scroll);
+
+    // Coalesce adjacent damaged rows
+    for (int row = 0, end; row < term->rows; row = end) {
+        for (end = row + 1; dirty[row] && end < term->rows && dirty[end]; end++);
+        if (dirty[row]) {
+            arr_push(frame->damage, (CellRect){ 0, row, term->cols, end - row });
+        }
+    }
+}
+
+// Copies the damaged rows into the snapshot, so the renderer can read them while the
+// parser keeps writing to the ring. The snapshot is rotated along with scrolls, so rows
+// that only moved aren't copied again
+static void
+update_snapshot(Term *term)
+{
+    Frame *frame = &term->frame;
+    const size_t size = (size_t)term->cols * term->rows;
+
+    if (size > term->snapshot_max) {
+        term->snapshot = xrealloc(term->snapshot, size, sizeof(*term->snapshot));
+        term->snapshot_max = size;
+    }
+    if (term->cols != term->snapshot_cols || term->rows != term->snapshot_rows) {
+        memset(term->dirty, 1, term->rows);
+        term->snapshot_cols = term->cols;
+        term->snapshot_rows = term->rows;
+        term->snapshot_top = 0;
+        frame->scroll = 0;
+    } else {
+        term->snapshot_top = uwrap(term->snapshot_top + frame->scroll, term->rows);
+    }
+
+    // The frame's row pointers double as scratch space for the ring's rows
+    ring_map_visible(term->ring, frame->lines);
+
+    for (int row = 0; row < term->rows; row++) {
+        const int n = (term->snapshot_top + row) % term->rows;
+        Cell *const dst = term->snapshot + (size_t)n * term->cols;
+        if (term->dirty[row]) {
+            memcpy(dst, frame->lines[row], term->cols * sizeof(*dst));
+        }
+        frame->lines[row] = dst;
+    }
+}
+
+// DECSCUSR styles come in blinking and steady pairs. Renderers only get the shape
+static CursorStyle
+cursor_shape(uint8 style)
+{
+    switch (style) {
+    case 3:
+    case 4:
+        return CursorStyleUnderscore;
+    case 5:
+    case 6:
+        return CursorStyleBar;
+    case CursorStyleOutline:
+        return CursorStyleOutline;
+    default:
+        return CursorStyleBlock;
+    }
+}
+
 // Temporary glue code for passing screen data to the renderer
 static Frame *
 generate_frame(Term *term)
 {
     Frame *frame = &term->frame;
 
-    ring_copy_framebuffer(term->ring, frame->cells);
     frame->cols = term->cols;
     frame->rows = term->rows;
     frame->width = term->cols * term->cwidth;
     frame->height = term->rows *term->cheight;
     frame->cursor.col = term->cur.x;
     frame->cursor.row = term->cur.y;
-    frame->cursor.style = term->cur.style;
-    frame->time = timer_msec(NULL);
+    frame->cursor.style = cursor_shape(term->cur.style);
     frame->palette = term->palette;
 
     if (!term->cur.hidden && check_visible(term->ring, term->cur.x, term->cur.y)) {
-        frame->cursor.visible = true;
+        term->cursor_shown = true;
         frame->cursor.row += ring_get_scroll(term->ring);
         ASSERT(frame->cursor.row < term->rows);
     } else {
-        frame->cursor.visible = false;
+        term->cursor_shown = false;
     }
 
+    // DECSCUSR: the default and odd styles blink
+    frame->cursor.blink = (!term->cur.style || (term->cur.style & 1));
+    frame->cursor.visible = term->cursor_shown && !(frame->cursor.blink && term->blink_off);
+
+    update_damage(term);
+    update_snapshot(term);
+    term->framed = true;
+
     return frame;
 }
 
+// Window properties set by the child are applied on the main thread
+static void
+apply_properties(Term *term)
+{
+    if (term->props & APPPROP_TITLE) {
+        app_set_properties(term->app, APPPROP_TITLE, term->title, arr_count(term->title));
+    }
+    if (term->props & APPPROP_ICON) {
+        app_set_properties(term->app, APPPROP_ICON, term->icon, arr_count(term->icon));
+    }
+
+    term->props = 0;
+}
+
 void
 term_draw(Term *term)
 {
@@ -246,29 +397,228 @@ term_draw(Term *term)
 
     gfx_clear_rgb1u(term->palette->bg);
     if (term->pid) {
-        gfx_draw_frame(generate_frame(term), term->fonts);
+        uint64 t = perf_now();
+        term_lock(term);
+        const Frame *frame = generate_frame(term);
+        apply_properties(term);
+        term_unlock(term);
+        perf_add(PERF_FRAME, t);
+
+        t = perf_now();
+        gfx_draw_frame(frame, term->fonts);
+        perf_add(PERF_DRAW, t);
     }
 }
 
-// Send data to the child
+// Redraws only the cursor of the last frame, after a change of the blink phase. The frame
+// belongs to the main thread, so this doesn't need the lock
+void
+term_draw_cursor(Term *term)
+{
+    ASSERT(term);
+
+    gfx_clear_rgb1u(term->palette->bg);
+    if (term->pid && term->framed) {
+        Frame *frame = &term->frame;
+        frame->cursor.visible = term->cursor_shown && !(frame->cursor.blink && term->blink_off);
+
+        const uint64 t = perf_now();
+        gfx_draw_cursor(frame, term->fonts);
+        perf_add(PERF_DRAW, t);
+    }
+}
+
+// Sets the phase of a blinking cursor, which takes effect with the next draw
+void
+term_set_blink(Term *term, bool on)
+{
+    term->blink_off = !on;
+}
+
+// Whether the last frame's cursor is shown, and blinks
+bool
+term_cursor_blinks(const Term *term)
+{
+    return (term->framed && term->cursor_shown && term->frame.cursor.blink);
+}
+
+// Writes as much of the output queue as the PTY accepts. Called with the output lock held
+static void
+flush_output(Term *term)
+{
+    while (term->outhead < term->outtail) {
+        const size_t count = pty_write(term->mfd,
+                                       term->output + term->outhead,
+                                       term->outtail - term->outhead);
+        if (!count) {
+            break;
+        }
+        term->outhead += count;
+    }
+
+    if (term->outhead == term->outtail) {
+        term->outhead = term->outtail = 0;
+    }
+}
+
+// Queue data for the child, and write as much of it as possible without blocking. The
+// rest is written by term_flush() once the PTY is writeable again. Writes are accepted
+// whole or not at all, so the child never sees a truncated sequence. Returns "len", or 0
+// if the queue is full. Large writes can't take the last OUTPUT_RESERVE bytes, which
+// are kept for keystrokes and replies
 size_t
 term_push(Term *term, const void *data, size_t len)
 {
-    return pty_write(term->mfd, data, len);
+    pthread_mutex_lock(&term->outlock);
+
+    const size_t queued = term->outtail - term->outhead;
+    const size_t limit = (len > OUTPUT_RESERVE) ? MAX_OUTPUT - OUTPUT_RESERVE : MAX_OUTPUT;
+
+    if (queued + len > limit) {
+        dbg_printf("Output queue full, refused %zu bytes\n", len);
+        len = 0;
+    }
+
+    if (len) {
+        if (term->outtail + len > term->outmax) {
+            if (queued) {
+                memmove(term->output, term->output + term->outhead, queued);
+            }
+            term->outhead = 0;
+            term->outtail = queued;
+            if (queued + len > term->outmax) {
+                term->outmax = MAX(queued + len, 2 * term->outmax);
+                term->output = xrealloc(term->output, term->outmax, 1);
+            }
+        }
+        memcpy(term->output + term->outtail, data, len);
+        term->outtail += len;
+        flush_output(term);
+    }
+
+    pthread_mutex_unlock(&term->outlock);
+
+    return len;
 }
 
-// Receive data from the child
+// Returns the number of bytes still queued for the child after writing what we can
 size_t
-term_pull(Term *term)
+term_flush(Term *term)
 {
-    ASSERT(term && term->pid);
+    pthread_mutex_lock(&term->outlock);
+    flush_output(term);
+    const size_t count = term->outtail - term->outhead;
+    pthread_mutex_unlock(&term->outlock);
 
-    const size_t len = pty_read(term->mfd, term->input, LEN(term->input));
-    if (len > 0) {
-        term_consume(term, term->input, len);
+    return count;
+}
+
+int
+term_get_fileno(const Term *term)
+{
+    return term->mfd;
+}
+
+// Returns the number of bytes parsed since the last call. If there were none, the
+// descriptor returned by term_exec() becomes readable when that changes
+size_t
+term_poll(Term *term)
+{
+    ASSERT(term && term->started);
+
+    wakepipe_clear(term->notify[0]);
+
+    size_t count = atomic_exchange(&term->parsed, 0);
+
+    if (!count) {
+        atomic_store(&term->idle, true);
+        // Same handshake as ptyreader_poll()
+        if ((count = atomic_exchange(&term->parsed, 0))) {
+            atomic_store(&term->idle, false);
+        }
     }
 
-    return len;
+    return count;
+}
+
+// Parse up to "max" bytes received from the child. Called with the lock held
+static size_t
+parse_input(Term *term, size_t max)
+{
+    size_t total = 0;
+
+    while (total < max) {
+        const uchar *data;
+        const size_t len = MIN(ptyreader_peek(term->reader, &data), max - total);
+        if (!len) {
+            break;
+        }
+        term_consume(term, data, len);
+        ptyreader_consume(term->reader, len);
+        total += len;
+    }
+
+    return total;
+}
+
+void *
+parser_main(void *arg)
+{
+    Term *const term = arg;
+
+    struct pollfd pollset[2] = {
+        { .fd = term->control[0], .events = POLLIN },
+        { .fd = ptyreader_fileno(term->reader), .events = POLLIN },
+    };
+
+    while (!atomic_load(&term->stop)) {
+        if (!ptyreader_poll(term->reader)) {
+            if (poll(pollset, LEN(pollset), -1) < 0) {
+                if (errno == EINTR) continue;
+                err_printf("poll: %s\n", strerror(errno));
+                break;
+            }
+            if (pollset[0].revents) {
+                wakepipe_clear(term->control[0]);
+            }
+            // The reader hung up and everything it read was parsed
+            if ((pollset[1].revents & POLLHUP) && !ptyreader_poll(term->reader)) {
+                break;
+            }
+            continue;
+        }
+
+        while (atomic_load(&term->waiting)) {
+            sched_yield();
+        }
+
+        const size_t chunk = (atomic_load(&term->flood)) ? FLOOD_CHUNK : PARSE_CHUNK;
+        const uint64 t = perf_now();
+        pthread_mutex_lock(&term->lock);
+        const size_t count = parse_input(term, chunk);
+        pthread_mutex_unlock(&term->lock);
+        perf_add(PERF_PARSE, t);
+        perf_add_bytes(count);
+
+        atomic_fetch_add(&term->parsed, count);
+        if (atomic_load(&term->idle) && atomic_exchange(&term->idle, false)) {
+            wakepipe_signal(term->notify[1]);
+        }
+    }
+
+    // Closing our end makes the main thread see a hangup
+    close(term->notify[1]);
+    term->notify[1] = -1;
+
+    return NULL;
+}
+
+// While flooded, the parser holds the lock longer between chances for the main thread
+// to take a snapshot
+void
+term_set_flood(Term *term, bool enable)
+{
+    atomic_store(&term->flood, enable);
 }
 
 void
@@ -276,38 +626,42 @@ term_scroll(Term *term, int delta)
 {
     // (delta < 0): scroll back in history
     // (delta > 0): scroll forward in history
+    term_lock(term);
     ring_adjust_scroll(term->ring, -delta);
+    term_unlock(term);
 }
 
 void
 term_reset_scroll(Term *term)
 {
+    term_lock(term);
     ring_reset_scroll(term->ring);
+    term_unlock(term);
 }
 
 bool
 term_toggle_trace(Term *term)
 {
-    term->tracing = !term->tracing;
-    fprintf(stderr, "[!] Trace %s\n", (term->tracing) ? "enabled" : "disabled");
-    return term->tracing;
+    term_lock(term);
+    const bool tracing = (term->tracing = !term->tracing);
+    term_unlock(term);
+
+    fprintf(stderr, "[!] Trace %s\n", (tracing) ? "enabled" : "disabled");
+
+    return tracing;
 }
 
 void
-alloc_frame(Frame *frame, uint16 cols_, uint16 rows_)
+alloc_frame(Frame *frame, uint8 **r_dirty, uint16 rows_)
 {
     ASSERT(frame);
+    ASSERT(r_dirty);
 
-    const int cols = MAX((int)cols_, frame->cols);
     const int rows = MAX((int)rows_, frame->rows);
 
-    if (cols && rows && (cols > frame->cols || rows > frame->rows)) {
-        if (!frame->cells) {
-            frame->cells = xcalloc(cols * rows, sizeof(*frame->cells));
-        } else {
-            frame->cells = xrealloc(frame->cells, cols * rows, sizeof(*frame->cells));
-        }
-        frame->cols = cols;
+    if (rows && (rows > frame->rows || !frame->lines)) {
+        frame->lines = xrealloc(frame->lines, rows, sizeof(*frame->lines));
+        *r_dirty = xrealloc(*r_dirty, rows, sizeof(**r_dirty));
         frame->rows = rows;
     }
 }
@@ -358,6 +712,8 @@ term_resize(Term *term, uint width, uint height)
         return;
     }
 
+    term_lock(term);
+
     // Compress the screen vertically.
     if (rows <= term->cur.y) {
         ring_adjust_head(term->rings[0], term->rows - rows);
@@ -377,13 +733,26 @@ term_resize(Term *term, uint width, uint height)
 
     // Resize extra buffers
     alloc_tabstops(&term->tabstops, term->max_cols, cols, term->tabcols);
-    alloc_frame(&term->frame, cols, rows);
+    alloc_frame(&term->frame, &term->dirty, rows);
+    term->framed = false;
 
-    // Resize psuedoterminal
-    pty_resize(term->mfd, cols, rows, term->cwidth, term->cheight);
-
-    // Commit changes
+    // Commit changes. The psuedoterminal is resized by term_sync_winsize()
     update_dimensions(term, cols, rows);
+
+    term_unlock(term);
+}
+
+// Reports the screen size to the child (which raises SIGWINCH), if it changed since the
+// last time. Deferred until the size settles, so the child doesn't redraw for every step
+// of an interactive resize
+void
+term_sync_winsize(Term *term)
+{
+    if (term->mfd && (term->cols != term->ws_cols || term->rows != term->ws_rows)) {
+        pty_resize(term->mfd, term->cols, term->rows, term->cwidth, term->cheight);
+        term->ws_cols = term->cols;
+        term->ws_rows = term->rows;
+    }
 }
 
 static inline void
@@ -677,12 +1046,17 @@ term_reset_cell(Term *term)
 void
 term_set_screen(Term *term, bool alt)
 {
-    term->ring = term->rings[alt];
+    if (term->ring != term->rings[alt]) {
+        term->ring = term->rings[alt];
+        ring_invalidate(term->ring);
+    }
 }
 
-void term_print_history(const Term *term)
+void term_print_history(Term *term)
 {
+    term_lock(term);
     dbg_print_ring(term->ring);
+    term_unlock(term);
 }
 
 // Will be used for line rewrapping
@@ -828,9 +1202,17 @@ emu_OSC(Term *term, const Parser *parser)
         break;
     }
 
-    if (props) {
-        app_set_properties(term->app, props, (const char *)str, len);
+    // Applied by the main thread when it draws the next frame
+    for (uint i = 0; i < 2; i++) {
+        char **const dst = (i) ? &term->icon : &term->title;
+        if (props & ((i) ? APPPROP_ICON : APPPROP_TITLE)) {
+            arr_clear(*dst);
+            for (size_t n = 0; n < len; n++) {
+                arr_push(*dst, str[n]);
+            }
+        }
     }
+    term->props |= props;
 
     return;
 }
@@ -34,16 +34,23 @@ typedef struct Term Term;
 Term *term_create(App *app);
 void term_destroy(Term *term);
 void term_resize(Term *term, uint width, uint height);
+void term_sync_winsize(Term *term);
 int term_exec(Term *term, const char *shell, int argc, const char *const *argv);
 void term_draw(Term *term);
-size_t term_pull(Term *term);
+void term_draw_cursor(Term *term);
+void term_set_blink(Term *term, bool on);
+bool term_cursor_blinks(const Term *term);
+size_t term_poll(Term *term);
+void term_set_flood(Term *term, bool enable);
 size_t term_push(Term *term, const void *data, size_t len);
+size_t term_flush(Term *term);
+int term_get_fileno(const Term *term);
 size_t term_push_input(Term *term, uint key, uint mod, const uchar *text, size_t len);
 void term_scroll(Term *term, int lines);
 void term_reset_scroll(Term *term);
 int term_cols(const Term *term);
 int term_rows(const Term *term);
-void term_print_history(const Term *term);
+void term_print_history(Term *term);
 void term_print_stream(const Term *term);
 bool term_toggle_trace(Term *term);
 
@@ -18,11 +18,15 @@
 #ifndef TERM_PRIVATE_H__
 #define TERM_PRIVATE_H__
 
+#include <pthread.h>
+#include <stdatomic.h>
+
 #include "common.h"
 #include "term.h"
 #include "term_ring.h"
 #include "cells.h"
 #include "opcodes.h"
+#include "ptyreader.h"
 
 static_assert(FontStyleRegular == ATTR_NONE, "Bitmask mismatch.");
 static_assert(FontStyleBold == ATTR_BOLD, "Bitmask mismatch.");
@@ -42,7 +46,13 @@ struct Parser {
     Sequence seq;          // Current UTF-8/escape sequence
 };
 
-enum { MAX_READ = 4096 };
+enum {
+    INPUT_RING_SIZE = (1 << 22), // Bytes buffered between the PTY and the parser
+    PARSE_CHUNK     = (1 << 16), // Bytes parsed per acquisition of the lock
+    FLOOD_CHUNK     = (1 << 18), // Likewise, while flooded
+    MAX_OUTPUT      = (1 << 20), // Bytes queued for the child before we refuse input
+    OUTPUT_RESERVE  = (1 << 12), // Part of the queue only writes up to this size can use
+};
 
 struct Term {
     App *app; // Global application handle
@@ -51,7 +61,27 @@ struct Term {
     int pid; // PTY PID
     int mfd; // PTY master file descriptor
     int sfd; // PTY slave file descriptor
-    uchar input[MAX_READ]; // PTY input buffer
+    PtyReader *reader; // Drains the PTY on its own thread
+
+    // Input is parsed on a worker thread, which holds the lock while it mutates the
+    // terminal. The main thread takes it to copy the screen, and for its own changes
+    pthread_t worker;
+    pthread_mutex_t lock;
+    bool started;
+    int control[2];          // Main thread -> parser (stop)
+    int notify[2];           // Parser -> main thread (new input parsed, or hangup)
+    atomic_bool stop;
+    atomic_bool idle;        // Main thread is waiting for updates
+    atomic_uint waiting;     // Main thread is waiting for the lock
+    atomic_bool flood;       // Favor parsing throughput over frame latency
+
+    // Bytes waiting for the child to read them. Both threads may queue replies/input
+    pthread_mutex_t outlock;
+    uchar *output;
+    size_t outhead;
+    size_t outtail;
+    size_t outmax;
+    _Atomic(size_t) parsed;  // Bytes parsed since the last term_poll()
 
     FontSet *fonts;
 
@@ -60,6 +90,7 @@ struct Term {
 
     uint8 *tabstops; // Current tabstop columns
     int tabcols;     // Columns per horizontal tab
+    uint8 *dirty;    // Per-row damage flags for the current frame
 
     int cols;      // Current screen columns
     int rows;      // Current screen rows
@@ -71,6 +102,8 @@ struct Term {
     int cwidth;    // Cell width in pixels
     int cheight;   // Cell height in pixels
     int histlines; // Maximum lines in scrollback history
+    int ws_cols;   // Screen columns last reported to the child
+    int ws_rows;   // Screen rows last reported to the child
 
     Cursor cur;
     struct {
@@ -78,7 +111,18 @@ struct Term {
     } saved;
 
     Frame frame;
+    bool framed;        // The frame was generated since the screen's size last changed
+    bool cursor_shown;  // Cursor is visible, regardless of the blink phase
+    bool blink_off;     // Blinking cursor is in its off phase
     Cell cell;
+    Cell *snapshot;     // Copy of the visible rows, which the frame points into
+    int snapshot_cols;  // Row stride of the snapshot
+    int snapshot_rows;
+    int snapshot_top;   // Snapshot row holding the top visible row (rows are a ring)
+    size_t snapshot_max;
+    char *title;        // Pending window title (dynamic array), applied on the main thread
+    char *icon;         // Pending icon name (dynamic array)
+    uint8 props;        // Pending property changes
 
     Parser parser;
     bool tracing;
@@ -26,6 +26,7 @@
 
 typedef struct {
     uint16 flags;
+    uint32 gen;
     Cell cells[];
 } Line;
 
@@ -37,6 +38,8 @@ struct Ring {
     int cols;
     int rows;
     int scroll;
+    uint32 epoch; // Generation stamped onto lines modified since the last commit
+    int *shown;   // Line indices of the visible rows at the last commit
 };
 
 #define LINESIZE(n) (offsetof(Line, cells) + sizeof(Cell) * (n))
@@ -72,6 +75,26 @@ get_visible_index(const Ring *ring, int row)
     return result;
 }
 
+// Stamps a line as modified in the current generation. Whole-line copies/clears overwrite
+// the header too, so those must be stamped afterwards
+static inline Line *
+touch_line(Ring *ring, int idx)
+{
+    Line *line = LINE(ring, idx);
+    line->gen = ring->epoch;
+
+    return line;
+}
+
+static void
+reset_shown(Ring *ring)
+{
+    ring->shown = xrealloc(ring->shown, ring->rows, sizeof(*ring->shown));
+    for (int row = 0; row < ring->rows; row++) {
+        ring->shown[row] = -1;
+    }
+}
+
 Ring *
 ring_create(int histlines, int cols, int rows)
 {
@@ -88,6 +111,8 @@ ring_create(int histlines, int cols, int rows)
     ring->base = 1;
     ring->head = 1;
     ring->max = histlines - 1;
+    ring->epoch = 1;
+    reset_shown(ring);
 
     return ring;
 }
@@ -99,6 +124,7 @@ ring_destroy(Ring *ring)
     if (ring->data) {
         free(ring->data);
     }
+    FREE(ring->shown);
     free(ring);
 }
 
@@ -126,6 +152,60 @@ ring_set_dimensions(Ring *ring, int cols, int rows)
 
     ring->cols = cols;
     ring->rows = rows;
+    reset_shown(ring);
+}
+
+// Forces every visible row to be reported as damaged by the next commit
+void
+ring_invalidate(Ring *ring)
+{
+    for (int row = 0; row < ring->rows; row++) {
+        ring->shown[row] = -1;
+    }
+}
+
+// Writes a damage flag for each visible row into the "dirty" array and begins a new
+// generation. Whole-screen scrolls (head movement, or scrolling through the history) move
+// every visible line by the same number of rows, which is written to "r_shift" (positive
+// if the contents moved up). A row is damaged if its line was modified since the last
+// commit, or if it isn't the line shown "shift" rows below it at the last commit.
+// Returns the number of damaged rows
+int
+ring_commit(Ring *ring, uint8 *dirty, int *r_shift)
+{
+    const int top = get_visible_index(ring, 0);
+    int shift = 0;
+
+    if (ring->shown[0] >= 0) {
+        const int down = uwrap(top - ring->shown[0], ring->max + 1);
+        const int up = uwrap(ring->shown[0] - top, ring->max + 1);
+
+        if (down > 0 && down < ring->rows) {
+            shift = down;
+        } else if (up > 0 && up < ring->rows) {
+            shift = -up;
+        }
+    }
+
+    // Rows are updated in the direction that reads each old entry before overwriting it
+    const int step = (shift < 0) ? -1 : 1;
+    int row = (shift < 0) ? ring->rows - 1 : 0;
+    int count = 0;
+
+    for (int n = 0; n < ring->rows; n++, row += step) {
+        const int idx = uwrap(top + row, ring->max + 1);
+        const int src = row + shift;
+        const int prev = (src >= 0 && src < ring->rows) ? ring->shown[src] : -1;
+
+        dirty[row] = (idx != prev || LINE(ring, idx)->gen == ring->epoch);
+        ring->shown[row] = idx;
+        count += dirty[row];
+    }
+
+    ring->epoch++;
+    SETPTR(r_shift, shift);
+
+    return count;
 }
 
 int
@@ -181,21 +261,21 @@ ring_adjust_head(Ring *ring, int delta)
             if (botidx == ring->base) {
                 ring->base += (ring->base != ring->max) ? 1 : -ring->max;
                 memset(LINE(ring, botidx), 0, LINESIZE(ring->cols));
+                touch_line(ring, botidx);
             }
         }
     }
 }
 
+// Writes a pointer to each visible row's cells into the "lines" array. The pointers alias
+// the ring's storage, so they're only valid until the ring is next modified or resized
 void
-ring_copy_framebuffer(const Ring *ring, Cell *frame)
+ring_map_visible(const Ring *ring, const Cell **lines)
 {
-    Cell *dst = frame;
     int idx = get_visible_index(ring, 0);
 
     for (int n = 0; n < ring->rows; n++) {
-        const Cell *src = LINE(ring, idx)->cells;
-        memcpy(dst, src, sizeof(*dst) * ring->cols);
-        dst += ring->cols;
+        lines[n] = LINE(ring, idx)->cells;
         idx += (idx != ring->max) ? 1 : -idx;
     }
 }
@@ -218,6 +298,7 @@ rows_clear(Ring *ring, int row, int count)
     for (int at = beg; at < end; at++) {
         const int dstidx = get_writeable_index(ring, at);
         memset(LINE(ring, dstidx), 0, LINESIZE(ring->cols));
+        touch_line(ring, dstidx);
     }
 }
 
@@ -235,6 +316,7 @@ rows_delete(Ring *ring, int row, int count)
         } else {
             memset(LINE(ring, dstidx), 0, LINESIZE(ring->cols));
         }
+        touch_line(ring, dstidx);
     }
 }
 
@@ -258,14 +340,16 @@ rows_move(Ring *ring, int row, int count, int shift)
 
         memmove(LINE(ring, dstln), LINE(ring, srcln), LINESIZE(ring->cols));
         memset(LINE(ring, srcln), 0, LINESIZE(ring->cols));
+        touch_line(ring, dstln);
+        touch_line(ring, srcln);
     }
 }
 
 Cell *
-cells_get(const Ring *ring, int col, int row)
+cells_get(Ring *ring, int col, int row)
 {
     const int idx = get_writeable_index(ring, row);
-    Cell *cells = LINE(ring, idx)->cells + col;
+    Cell *cells = touch_line(ring, idx)->cells + col;
 
     return cells;
 }
@@ -285,7 +369,7 @@ cells_set(Ring *ring, Cell cell, int col, int row, int count)
     const int beg = MIN(col, ring->cols);
     const int end = MIN(beg + count, ring->cols);
     const int idx = get_writeable_index(ring, row);
-    Cell *cells = LINE(ring, idx)->cells;
+    Cell *cells = touch_line(ring, idx)->cells;
 
     for (int at = beg; at < end; at++) {
         cells[at] = cell;
@@ -298,7 +382,7 @@ cells_clear(Ring *ring, int col, int row, int count)
     const int beg = MIN(col, ring->cols);
     const int end = MIN(beg + count, ring->cols);
     const int idx = get_writeable_index(ring, row);
-    Cell *cells = LINE(ring, idx)->cells;
+    Cell *cells = touch_line(ring, idx)->cells;
 
     memset(&cells[beg], 0, (end - beg) * sizeof(*cells));
 }
@@ -309,7 +393,7 @@ cells_delete(Ring *ring, int col, int row, int count)
     const int beg = MIN(col, ring->cols);
     const int end = MIN(beg + count, ring->cols);
     const int idx = get_writeable_index(ring, row);
-    Cell *cells = LINE(ring, idx)->cells;
+    Cell *cells = touch_line(ring, idx)->cells;
 
     memmove(&cells[beg], &cells[end], (ring->cols - end) * sizeof(Cell));
 
@@ -322,7 +406,7 @@ cells_insert(Ring *ring, Cell cell, int col, int row, int count)
     const int beg = MIN(col, ring->cols);
     const int end = MIN(beg + count, ring->cols);
     const int idx = get_writeable_index(ring, row);
-    Cell *cells = LINE(ring, idx)->cells;
+    Cell *cells = touch_line(ring, idx)->cells;
 
     memmove(&cells[end], &cells[beg], (ring->cols - end) * sizeof(Cell));
 
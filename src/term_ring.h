@@ -31,9 +31,11 @@ int ring_get_scroll(const Ring *ring);
 int ring_adjust_scroll(Ring *ring, int delta);
 int ring_reset_scroll(Ring *ring);
 void ring_adjust_head(Ring *ring, int delta);
-void ring_copy_framebuffer(const Ring *ring, Cell *frame);
+void ring_map_visible(const Ring *ring, const Cell **lines);
 void ring_set_dimensions(Ring *ring, int cols, int rows);
-Cell *cells_get(const Ring *ring, int col, int row);
+void ring_invalidate(Ring *ring);
+int ring_commit(Ring *ring, uint8 *dirty, int *r_shift);
+Cell *cells_get(Ring *ring, int col, int row);
 Cell *cells_get_visible(const Ring *ring, int col, int row);
 void cells_set(Ring *ring, Cell cell, int col, int row, int count);
 void cells_clear(Ring *ring, int col, int row, int count);
@@ -311,10 +311,10 @@ uint64
 timer_nsec(TimeRec *ret)
 {
     struct timespec ts;
-    uint32 t = 0;
+    uint64 t = 0;
 
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    t += ts.tv_sec * 1e9;
+    t += ts.tv_sec * UINT64_C(1000000000);
     t += ts.tv_nsec;
 
     if (ret) *ret = from_timespec(&ts);
@@ -322,3 +322,49 @@ timer_nsec(TimeRec *ret)
     return t;
 }
 
+
+bool
+wakepipe_open(int fds[2])
+{
+    if (pipe(fds) < 0) {
+        fds[0] = fds[1] = -1;
+        return false;
+    }
+
+    for (uint i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    return true;
+}
+
+void
+wakepipe_close(int fds[2])
+{
+    for (uint i = 0; i < 2; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+void
+wakepipe_signal(int fd)
+{
+    const uchar c = 0;
+
+    // A full pipe already holds a pending wakeup
+    if (write(fd, &c, 1) < 0) {
+        ASSERT(errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
+
+void
+wakepipe_clear(int fd)
+{
+    uchar buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+}
@@ -109,6 +109,12 @@ uint32 timer_msec(TimeRec *);
 uint32 timer_usec(TimeRec *);
 uint64 timer_nsec(TimeRec *);
 
+// Non-blocking pipe for waking a thread that sleeps in poll()
+bool wakepipe_open(int fds[2]);
+void wakepipe_close(int fds[2]);
+void wakepipe_signal(int fd);
+void wakepipe_clear(int fd);
+
 static inline bool strempty(const char *str) { return !(str && str[0]); }
 
 static inline int64 imin(int64 a, int64 b) { return MIN(a, b); }
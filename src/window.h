@@ -35,12 +35,13 @@ typedef struct {
     uint min_height;
 } WinConfig;
 
-Win *window_create(void);
+Win *window_create(bool software);
 bool window_configure(Win *win, WinConfig cfg);
 void window_destroy(Win *win);
 bool window_open(Win *win, int *width, int *height);
 bool window_make_current(const Win *win);
 bool window_online(const Win *win);
+bool window_is_software(const Win *win);
 float window_get_dpi(const Win *win);
 int window_get_fileno(const Win *win);
 bool window_query_color(const Win *, const char *name, uint32 *color);
@@ -49,6 +50,7 @@ void window_get_size(const Win *win, int *width, int *height);
 void window_set_title(Win *win, const char *name, size_t len);
 void window_set_icon(Win *win, const char *name, size_t len);
 void window_refresh(const Win *win);
+void window_set_vsync(const Win *win, bool enable);
 int window_width(const Win *win);
 int window_height(const Win *win);
 
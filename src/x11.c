@@ -19,6 +19,7 @@
 #include "window.h"
 #include "events.h"
 #include "x11.h"
+#include "gfx_software.h"
 
 #include <errno.h>
 #include <locale.h>
@@ -141,8 +142,12 @@ static Atom wm_atoms[NUM_ATOM];
 
 static Server server;
 
-static bool server_init(void);
+static bool server_init(bool);
 static void server_fini(void);
+static bool resize_surface(Win *);
+static bool image_create(Win *, int, int);
+static void image_destroy(Win *);
+static void image_present(Win *, int, int, int, int);
 static void query_dimensions(Win *, int *, int *);
 static void query_coordinates(Win *, int *, int *);
 static uint convert_keysym(KeySym);
@@ -155,7 +160,7 @@ static int pump_events(Win *, WinEventHandler *, void *);
 static int queue_length(bool);
 
 bool
-server_init(void)
+server_init(bool software)
 {
     if (server.dpy) {
         return true;
@@ -166,11 +171,17 @@ server_init(void)
     if (!(server.dpy = XOpenDisplay(NULL))) {
         return false;
     }
-    if (!(server.gfx = gfx_create_context(server.dpy))) {
-        return false;
+    if (!software && !(server.gfx = gfx_create_context(server.dpy))) {
+        err_printf("Failed to create graphics context, using the software renderer\n");
+        software = true;
     }
 
-    gfx_print_info(server.gfx);
+    if (software) {
+        server.software = true;
+        server.shm = XShmQueryExtension(server.dpy);
+    } else {
+        gfx_print_info(server.gfx);
+    }
 
     server.screen = DefaultScreen(server.dpy);
     server.dpy_width = DisplayWidth(server.dpy, server.screen);
@@ -249,7 +260,21 @@ server_init(void)
     }
 #undef INTERN_ATOM
 
-    {
+    if (server.software) {
+        // The software renderer writes 0x00RRGGBB pixels as-is
+        server.visual   = DefaultVisual(server.dpy, server.screen);
+        server.depth    = DefaultDepth(server.dpy, server.screen);
+        server.colormap = XCreateColormap(server.dpy, server.root, server.visual, AllocNone);
+
+        if (server.visual->class != TrueColor ||
+            server.visual->red_mask != 0xff0000 ||
+            server.visual->green_mask != 0x00ff00 ||
+            server.visual->blue_mask != 0x0000ff)
+        {
+            err_printf("Default visual isn't supported by the software renderer\n");
+            return false;
+        }
+    } else {
         XVisualInfo visreq = { 0 };
         XVisualInfo *visinfo;
         int count_;
@@ -354,10 +379,10 @@ query_coordinates(Win *win, int *r_x, int *r_y)
 }
 
 Win *
-window_create(void)
+window_create(bool software)
 {
     if (!server.dpy) {
-        if (!server_init()) {
+        if (!server_init(software)) {
             return NULL;
         }
     }
@@ -484,22 +509,31 @@ window_configure(Win *win, WinConfig cfg)
         win->gc = XCreateGC(server.dpy, server.root, GCGraphicsExposures, &gcvals);
     }
 
-    if (!gfx_bind_surface(server.gfx, win->xid)) {
-        err_printf("Failed to bind window surface\n");
-        return false;
-    }
-
-    {
-        int w1, h1, w2, h2;
-        query_dimensions(win, &w1, &h1);
-        gfx_get_size(server.gfx, &w2, &h2);
-        if (w1 != w2 || h1 != h2) {
-            err_printf("Mismatched window/viewport size\n");
+    if (!server.software) {
+        if (!gfx_bind_surface(server.gfx, win->xid)) {
+            err_printf("Failed to bind window surface\n");
             return false;
         }
+
+        {
+            int w1, h1, w2, h2;
+            query_dimensions(win, &w1, &h1);
+            gfx_get_size(server.gfx, &w2, &h2);
+            if (w1 != w2 || h1 != h2) {
+                err_printf("Mismatched window/viewport size\n");
+                return false;
+            }
+        }
+
+        gfx_set_debug_object(win);
     }
 
-    gfx_set_debug_object(win);
+    // Without a window manager, nothing guarantees a ConfigureNotify before the window is
+    // shown, so start out with its current size
+    query_dimensions(win, &win->width, &win->height);
+    if (!resize_surface(win)) {
+        return false;
+    }
 
     // Broadcast $WINDOWID (inherited by child process)
     char idstr[32] = { 0 };
@@ -517,6 +551,7 @@ window_destroy(Win *win)
     if (!win) return;
 
     gfx_bind_surface(server.gfx, 0);
+    image_destroy(win);
 
     if (win->xid) {
         XDestroyWindow(server.dpy, win->xid);
@@ -634,18 +669,193 @@ window_online(const Win *win)
     return (win) ? win->online : false;
 }
 
+void
+window_set_vsync(const Win *win, bool enable)
+{
+    gfx_set_vsync(server.gfx, enable);
+}
+
 void
 window_refresh(const Win *win)
 {
     if (window_online(win)) {
-        gfx_swap_buffers(server.gfx);
+        if (!server.software) {
+            gfx_swap_buffers(server.gfx);
+        } else if (win->image) {
+            int y, height;
+            if (gfx_software_get_damage(&y, &height)) {
+                image_present((Win *)win, 0, y, win->image->width, height);
+            }
+        }
     }
 }
 
 bool
 window_make_current(const Win *win)
 {
-    return (win && server.gfx);
+    return (win && (server.gfx || server.software));
+}
+
+bool
+window_is_software(const Win *win)
+{
+    return server.software;
+}
+
+bool
+resize_surface(Win *win)
+{
+    if (server.software) {
+        return image_create(win, win->width, win->height);
+    }
+
+    gfx_resize(server.gfx, win->width, win->height);
+
+    return true;
+}
+
+static bool shm_error;
+
+static int
+on_shm_error(Display *dpy, XErrorEvent *event)
+{
+    shm_error = true;
+    return 0;
+}
+
+static bool
+attach_shm(Win *win)
+{
+    XShmSegmentInfo *const info = &win->shminfo;
+    const size_t size = (size_t)win->image->bytes_per_line * win->image->height;
+
+    info->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT|0600);
+    if (info->shmid < 0) {
+        return false;
+    }
+
+    info->shmaddr = shmat(info->shmid, NULL, 0);
+    info->readOnly = False;
+
+    if (info->shmaddr != (char *)-1) {
+        // A remote server can't attach, which is only reported asynchronously
+        shm_error = false;
+        XErrorHandler handler = XSetErrorHandler(on_shm_error);
+        XShmAttach(server.dpy, info);
+        XSync(server.dpy, False);
+        XSetErrorHandler(handler);
+
+        if (shm_error) {
+            shmdt(info->shmaddr);
+            info->shmaddr = (char *)-1;
+        }
+    }
+
+    // The segment itself goes away once both sides have detached
+    shmctl(info->shmid, IPC_RMID, NULL);
+
+    if (info->shmaddr == (char *)-1) {
+        memset(info, 0, sizeof(*info));
+        return false;
+    }
+
+    win->image->data = info->shmaddr;
+
+    return true;
+}
+
+// Allocates the image the software renderer draws to, in memory shared with the server if
+// possible. Otherwise, each present copies the pixels through the connection
+bool
+image_create(Win *win, int width, int height)
+{
+    image_destroy(win);
+
+    if (server.shm) {
+        win->image = XShmCreateImage(server.dpy,
+                                     server.visual,
+                                     server.depth,
+                                     ZPixmap,
+                                     NULL,
+                                     &win->shminfo,
+                                     width,
+                                     height);
+        if (win->image && !attach_shm(win)) {
+            XDestroyImage(win->image);
+            win->image = NULL;
+        }
+        if (!win->image) {
+            err_printf("MIT-SHM unavailable, falling back to XPutImage\n");
+            server.shm = false;
+        }
+    }
+
+    if (!server.shm) {
+        win->image = XCreateImage(server.dpy,
+                                  server.visual,
+                                  server.depth,
+                                  ZPixmap,
+                                  0,
+                                  NULL,
+                                  width,
+                                  height,
+                                  32,
+                                  0);
+        if (win->image) {
+            // Xlib converts to the server's byte order when the image is sent
+            const uint32 word = 1;
+            win->image->byte_order = (*(const uchar *)&word) ? LSBFirst : MSBFirst;
+            win->image->data = xcalloc(win->image->height, win->image->bytes_per_line);
+        }
+    }
+
+    if (!win->image || win->image->bits_per_pixel != 32) {
+        err_printf("Failed to create %dx%d image\n", width, height);
+        image_destroy(win);
+        return false;
+    }
+
+    gfx_software_bind(&(GfxImage){
+        .pixels = (uint32 *)win->image->data,
+        .width  = width,
+        .height = height,
+        .stride = win->image->bytes_per_line / sizeof(uint32)
+    });
+
+    return true;
+}
+
+void
+image_destroy(Win *win)
+{
+    if (!win->image) {
+        return;
+    }
+
+    gfx_software_bind(NULL);
+
+    if (win->shminfo.shmaddr) {
+        XShmDetach(server.dpy, &win->shminfo);
+        shmdt(win->shminfo.shmaddr);
+        memset(&win->shminfo, 0, sizeof(win->shminfo));
+        win->image->data = NULL;
+    }
+
+    XDestroyImage(win->image);
+    win->image = NULL;
+}
+
+void
+image_present(Win *win, int x, int y, int width, int height)
+{
+    if (win->shminfo.shmaddr) {
+        XShmPutImage(server.dpy, win->xid, win->gc, win->image, x, y, x, y, width, height, False);
+        // The next frame is drawn to the same memory, so wait until the server is done with it
+        XSync(server.dpy, False);
+    } else {
+        XPutImage(server.dpy, win->xid, win->gc, win->image, x, y, x, y, width, height);
+        XFlush(server.dpy);
+    }
 }
 
 int
@@ -884,10 +1094,34 @@ DEFAULT_HANDLER(buttonpress, EVENT_BUTTONPRESS)
 DEFAULT_HANDLER(buttonrelease, EVENT_BUTTONRELEASE)
 DEFAULT_HANDLER(focusin, EVENT_FOCUS)
 DEFAULT_HANDLER(focusout, EVENT_UNFOCUS)
-DEFAULT_HANDLER(expose, EVENT_EXPOSE)
 DEFAULT_HANDLER(keyrelease, EVENT_KEYRELEASE)
 #undef DEFAULT_HANDLER
 
+inline bool
+process_expose(const X11EventProcParams *params)
+{
+    XExposeEvent *xevent = &params->xevent->xexpose;
+    Win *const win = params->win;
+
+    // The image still holds the last frame, so the exposed area is restored without
+    // drawing anything
+    if (win->image) {
+        const int width = MIN(xevent->width, win->image->width - xevent->x);
+        const int height = MIN(xevent->height, win->image->height - xevent->y);
+        if (width > 0 && height > 0) {
+            image_present(win, xevent->x, xevent->y, width, height);
+        }
+    }
+
+    WinEvent event;
+    event_init(&event, EVENT_EXPOSE, 0);
+    if (params->handler) {
+        params->handler(params->arg, &event);
+    }
+
+    return true;
+}
+
 inline bool
 process_motionnotify(const X11EventProcParams *params)
 {
@@ -945,6 +1179,13 @@ process_unmapnotify(const X11EventProcParams *params)
 inline bool
 process_configurenotify(const X11EventProcParams *params)
 {
+    // Only the latest geometry matters, so skip ahead to the last one queued. Dragging a
+    // window's edge easily generates dozens of these per frame
+    while (XCheckTypedWindowEvent(server.dpy,
+                                  params->win->xid,
+                                  ConfigureNotify,
+                                  params->xevent));
+
     XConfigureEvent *xevent = &params->xevent->xconfigure;
     WinGeomEvent event;
 
@@ -963,9 +1204,9 @@ process_configurenotify(const X11EventProcParams *params)
     if (event.width != params->win->width ||
         event.height != params->win->height)
     {
-        gfx_resize(server.gfx, event.width, event.height);
         params->win->width  = event.width;
         params->win->height = event.height;
+        resize_surface(params->win);
     }
 
     params->win->x = event.x;
@@ -1000,6 +1241,7 @@ process_keypress(const X11EventProcParams *params)
     event.key  = convert_keysym(xkey);
     event.mods = convert_modmask(xevent->state);
     event.len  = len;
+    event.srvtime = xevent->time;
 
     if (!event.len  &&
         !event.key  &&
@@ -27,6 +27,9 @@
 #include <X11/keysym.h>
 #include <X11/XF86keysym.h>
 #include <X11/Xatom.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
 
 typedef struct Server Server;
 
@@ -35,6 +38,8 @@ struct Win {
     Window xid;
     XIC ic;
     GC gc;
+    XImage *image;           // Software rendering target
+    XShmSegmentInfo shminfo; // Image memory shared with the server (if shmaddr is set)
     bool online;
     bool mapped;
     bool visible;
@@ -59,6 +64,8 @@ struct Server {
     float dpi;
     int depth;
     Gfx *gfx;
+    bool software; // Draw with the CPU renderer, instead of EGL/GLES
+    bool shm;      // The server supports MIT-SHM
     Win clients[1];
 };
 